@@ -6,8 +6,23 @@
 #include <math.h>
 #include <assert.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <vulkan/vulkan.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ELHAM_X86
+#endif
 #include <x265.h>
+#include "config.h"
+#include "shaders.h"
 
 #define VK_CHECK_RESULT(f) 																				\
 {																										\
@@ -38,102 +53,583 @@ typedef struct {
     Vec3 color;
 } Vertex;
 
-typedef void (*callback_t)(const char *, VkDeviceSize);
+// The Transform uniform of shader.vert, std140: the columns of a mat2 are padded to a vec4.
+typedef struct {
+    float rotation[2][4];
+    Vec2 center;
+} Transform;
+
+// What primitives look like, each a range of the shared mesh buffers, see meshes.
+typedef enum {
+    SHAPE_TRIANGLE,
+    SHAPE_QUAD,
+    SHAPE_COUNT
+} Shape;
+
+// The per-instance attributes of shader.vert: where a shape goes, its size, and what its vertex colours are scaled by.
+typedef struct {
+    Vec2 offset;
+    Vec2 scale;
+    Vec3 tint;
+} Instance;
+
+typedef struct {
+    Shape shape;
+    Instance instance;
+} Primitive;
+
+typedef enum {
+    SYNC_FENCES,    // stages chained with binary semaphores, one fence per frame
+    SYNC_TIMELINE   // stages chained with one timeline semaphore per frame, submitted at once
+} SyncMode;
+
+typedef void (*callback_t)(const char *, VkDeviceSize, uint32_t width, uint32_t height);
 typedef void (*ycbcr_callback_t)(void *y, void *cb, void *cr);
 
+/*
+ * One large vkAllocateMemory that images and buffers are carved out of. Space is handed out front to back and the
+ * block is rewound once everything in it has been freed. Host-visible blocks are mapped for their whole lifetime.
+ */
+typedef struct MemoryBlock {
+    VkDeviceMemory memory;
+    uint32_t memoryTypeIndex;
+    VkDeviceSize size;
+    VkDeviceSize used;
+    uint32_t live;
+    // whether the last resource placed in the block is linear, see bufferImageGranularity
+    bool lastLinear;
+    char *data;
+    struct MemoryBlock *next;
+} MemoryBlock;
+
+typedef struct {
+    MemoryBlock *blocks;
+    VkDeviceSize blockSize;
+    VkDeviceSize granularity;
+    uint32_t maxBlocks;
+
+    uint32_t blockCount;
+    uint32_t allocationCount;
+    VkDeviceSize reserved;
+    VkDeviceSize inUse;
+    VkDeviceSize peakInUse;
+} MemoryArena;
+
+/*
+ * A piece of a memory block backing one image or buffer. For host-visible memory data points at the resource. For
+ * linear images the subresource layout is queried once as well.
+ */
+typedef struct {
+    MemoryBlock *block;
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    VkDeviceSize memorySize;
+    VkMemoryPropertyFlags flags;
+    char *data;
+    VkSubresourceLayout layout;
+} Allocation;
+
+/*
+ * Y'CbCr kernels: ycbcr.comp writes three r8 plane images, ycbcr_packed.comp packed words into one buffer, and the CPU
+ * converter reads a linear RGBA copy of the frame on the host, see CpuConverter.
+ */
+typedef enum {
+    KERNEL_IMAGE,
+    KERNEL_PACKED,
+    KERNEL_CPU
+} Kernel;
+
+char const *const kernelNames[] = {"image", "packed", "cpu"};
+
+// Y'CbCr matrix coefficients, see colorMatrices.
+typedef enum {
+    MATRIX_BT709,
+    MATRIX_BT601,
+    MATRIX_BT2020
+} Matrix;
+
+// Where a chroma sample sits relative to the 2x2 block of luma samples it covers.
+typedef enum {
+    CHROMA_LEFT,    // between the two left samples, H.273 chroma location 0
+    CHROMA_CENTER   // in the middle of all four, chroma location 1
+} ChromaSiting;
+
+// How the Y'CbCr samples are subsampled and laid out in planes, see pixelFormats.
+typedef enum {
+    FORMAT_I420,
+    FORMAT_NV12,
+    FORMAT_I422,
+    FORMAT_I444
+} PixelFormat;
+
+// What the Y'CbCr kernels produce, and what the encoder is told it gets.
+typedef struct {
+    PixelFormat format;
+    Matrix matrix;
+    bool fullRange;
+    ChromaSiting siting;
+    // bits per sample, 8 or 10; more than 8 are stored in 16 bits
+    uint32_t depth;
+} ColorFormat;
+
+// Host copy of the Conversion uniform block of the Y'CbCr kernels, laid out as std140.
+typedef struct {
+    // columns of the RGB to Y'CbCr matrix, each padded to a vec4
+    float matrix[3][4];
+    float scale[2];
+    float offset[2];
+    float peak;
+    float unorm;
+    float siting;
+    float padding;
+    float transfer[256];
+} Conversion;
+
+/*
+ * The Conversion as the CPU converter uses it: every term of the matrix product, with the transfer function applied,
+ * for every 8-bit input, so that a sample is three lookups and two additions, in the order ycbcr.comp adds them.
+ */
+typedef struct {
+    // [row of the matrix][R, G or B][input value]
+    float terms[3][3][256];
+    float scale[2];
+    float offset[2];
+    float peak;
+    // weights of the left and right column of a 2x2 block in its chroma sample
+    float siting;
+    float notSiting;
+} CpuTables;
+
+// One frame for the CPU converter: a linear RGBA8 image in, 8-bit I420 or NV12 planes out.
+typedef struct {
+    uint8_t const *rgba;
+    size_t pitch;
+    uint32_t width;
+    uint32_t height;
+    uint8_t *y;
+    // NV12: Cb and Cr alternate in cb, and cr is not used
+    uint8_t *cb;
+    uint8_t *cr;
+    bool interleaved;
+} CpuJob;
+
+// Converts row pairs [first, last) of a job.
+typedef void (*cpu_rows_t)(CpuTables const *t, CpuJob const *job, uint32_t first, uint32_t last);
+
+/*
+ * KERNEL_CPU: converts frames in bands of row pairs, one per thread, with the widest instruction set the CPU has. The
+ * thread asking for a frame converts the first band itself while the workers take the others.
+ */
+typedef struct CpuConverter {
+    CpuTables tables;
+    cpu_rows_t rows;
+    char const *isa;
+
+    struct CpuWorker *workers;
+    // the caller included
+    uint32_t threadCount;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    // bumped for every job, workers convert a band whenever it changes
+    unsigned generation;
+    uint32_t remaining;
+    bool quit;
+    CpuJob job;
+} CpuConverter;
+
+typedef struct CpuWorker {
+    CpuConverter *converter;
+    uint32_t index;
+    pthread_t thread;
+} CpuWorker;
+
 typedef struct {
     VkQueue queue;
     uint32_t queueFamilyIndex;
 
     VkShaderModule shader;
+    Kernel kernel;
+    // invocations per workgroup in x and y, each converting one 2x2 block of pixels, or four with KERNEL_PACKED
+    uint32_t workgroup[2];
 
     VkFormat format;
+    // uniform buffer with the Conversion of e->color, shared by all frames
+    VkBuffer conversion;
+    Allocation conversionMemory;
+
+    VkCommandPool commandPool;
+    VkPipeline pipeline;
+    VkPipelineLayout pipelineLayout;
+    VkDescriptorPool descriptorPool;
+    VkDescriptorSetLayout descriptorSetLayout;
 
+    ycbcr_callback_t callback;
+    CpuConverter cpu;
+} YCbCr;
+
+// Y'CbCr resources owned by a single frame in flight.
+typedef struct {
     VkImage y;
-    VkDeviceMemory yMemory;
+    Allocation yMemory;
     VkImageView yView;
 
     VkImage cb;
-    VkDeviceMemory cbMemory;
+    Allocation cbMemory;
     VkImageView cbView;
 
     VkImage cr;
-    VkDeviceMemory crMemory;
+    Allocation crMemory;
     VkImageView crView;
 
+    // the planes back to back in the pixel format and sample size of e->color, see frameSize(), only used with
+    // device-local planes
+    VkBuffer readback;
+    Allocation readbackMemory;
+
+    // the planes KERNEL_CPU writes, contiguous like readback
+    uint8_t *host;
+
     VkImageView inputView;
     VkFence fence;
     VkCommandBuffer commandBuffer;
-    VkCommandPool commandPool;
-    VkPipeline pipeline;
-    VkPipelineLayout pipelineLayout;
     VkDescriptorSet descriptorSet;
-    VkDescriptorSetLayout descriptorSetLayout;
+} YCbCrFrame;
 
-    ycbcr_callback_t callback;
-} YCbCr;
+// Host view of a converted frame, as handed to the encoder. NV12 has two planes, Cb and Cr alternating in the second.
+typedef struct {
+    const char *data[3];
+    size_t stride[3];
+    uint32_t count;
+} Planes;
+
+// Stages of a frame the benchmark reports on. The first GPU_STAGE_COUNT are timed on the GPU with timestamp queries.
+typedef enum {
+    STAGE_RENDER,
+    STAGE_COPY,
+    STAGE_YCBCR,
+    STAGE_READBACK,
+    STAGE_WAIT,
+    STAGE_MAP,
+    STAGE_ENCODE,
+    // recording every command buffer of a stream again, what each frame would cost without recording them once at
+    // setup, see benchmarkRecording()
+    STAGE_RECORD,
+    STAGE_COUNT
+} Stage;
+
+#define GPU_STAGE_COUNT (STAGE_READBACK + 1)
+
+char const *const stageNames[STAGE_COUNT] = {
+    "render", "copy", "ycbcr", "readback", "fence_wait", "map_planes", "x265_encode", "record"
+};
 
+// Timings of one stage, in milliseconds.
+typedef struct {
+    double *values;
+    uint32_t count;
+    uint32_t capacity;
+} Samples;
+
+/*
+ * Primitives in device-local buffers, drawn with one indexed, instanced draw per Shape. The draws are read from the
+ * draws buffer by vkCmdDrawIndexedIndirect, so recording a frame costs the same however many primitives there are.
+ * Shared by every stream on the device.
+ */
+typedef struct {
+    VkBuffer vertices;
+    Allocation verticesMemory;
+    VkBuffer indices;
+    Allocation indicesMemory;
+    VkBuffer instances;
+    Allocation instancesMemory;
+    VkBuffer draws;
+    Allocation drawsMemory;
+    // also on the host, for devices that can not take a first instance from an indirect draw
+    VkDrawIndexedIndirectCommand commands[SHAPE_COUNT];
+    uint32_t drawCount;
+    uint32_t instanceCount;
+    // several draws per vkCmdDrawIndexedIndirect, and indirect draws that start past instance 0
+    bool multiDraw;
+    bool firstInstance;
+} Scene;
+
+// Everything a frame touches between rendering and encoding, so that several frames can be in flight at once.
+typedef struct {
+    VkImage srcImage;
+    Allocation srcImageMemory;
+    VkImageView srcImageView;
+    VkFramebuffer framebuffer;
+    // this frame's render, copy and Y'CbCr commands, owned by the stream, see recordCommands()
+    VkCommandBuffer renderCommandBuffer;
+    // where this frame draws the vertices, only written once the frame has retired
+    VkBuffer transform;
+    Allocation transformMemory;
+    VkDescriptorSet transformSet;
+    VkImage dstImage;
+    Allocation dstImageMemory;
+    VkCommandBuffer copyCommandBuffer;
+    VkFence renderFence;
+    VkFence copyFence;
+    VkSemaphore rendered;
+    VkSemaphore copied;
+    VkSemaphore timeline;
+    uint64_t timelineValue;
+    // a begin and an end timestamp per GPU stage, only when the queues support timestamps, see pickTimestamps()
+    VkQueryPool queries;
+
+    bool pending;
+    unsigned number;
+    // encoder queue index the frame's planes were handed over under, see reclaimFrame()
+    bool queued;
+    unsigned ticket;
+
+    YCbCrFrame ycbcr;
+} Frame;
+
+/*
+ * A converted frame waiting for the encoder thread. The planes point straight into the frame's mapped memory, except
+ * for NV12, which is split into I420 in data first.
+ */
+typedef struct {
+    Planes planes;
+    char *data;
+    unsigned number;
+} EncodeSlot;
+
+/*
+ * x265 runs on its own thread, fed through a bounded single-producer/single-consumer ring. The render loop writes at
+ * head, the encoder reads at tail; both only ever move forward and a slot is index % depth. Each side waits only when
+ * the ring is full or empty respectively, and adds the time it waited to its stall counter.
+ *
+ * Slots lend the frame's planes to x265 without copying them. x265_encoder_encode() copies its input into its own
+ * padded frames, lookahead and B-frames included, so a frame's planes are free again once tail has moved past its
+ * slot; the render loop waits for that in reclaimFrame() before rendering into the frame again. A stream has depth
+ * more frames than it has in flight, so by then depth more frames have been queued behind it, and encode() will
+ * already have waited for its slot to be taken: reclaimFrame() only waits when the ring is full.
+ */
+typedef struct {
+    EncodeSlot *slots;
+    uint32_t depth;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_bool closed;
+    pthread_t thread;
+
+    // the libx265 build for the configured bit depth
+    x265_api const *api;
+    x265_param *param;
+    x265_encoder *encoder;
+    x265_picture *picIn;
+    x265_picture *picOut;
+    // Annex-B elementary stream, every NAL of every frame is appended here
+    int output;
+
+    // seconds, each written only by its own side
+    double producerStall;
+    double consumerStall;
+    unsigned encoded;
+    Samples *stats;
+} Encoder;
+
+// What --check compares, see checkCpuRows() and checkYCbCr().
+typedef enum {
+    CHECK_NONE,
+    // the vector CPU converters against the scalar one, without a device
+    CHECK_CPU,
+    // that, and the Y'CbCr kernel against the CPU converter
+    CHECK_ALL
+} Check;
+
+// What to render and how to encode it, from the command line.
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    // frames to render, 0 = until interrupted
+    unsigned frames;
+    // frames on the GPU at once, 1 renders, converts and encodes one frame after the other
+    uint32_t inFlight;
+    // converted frames queued for the encoder thread, each lending the planes of a frame of its own
+    uint32_t queueDepth;
+    char const *fps;
+    char const *preset;
+    char const *tune;
+    // kbit/s, 0 keeps the preset's rate control
+    unsigned bitrate;
+    // where the stream goes, "-" for standard output
+    char const *output;
+    // device to use instead of the best scoring one, by number or name, or a comma-separated list of them
+    char const *device;
+    Kernel kernel;
+    ColorFormat color;
+    // independent animations, each into its own output, split between the devices, 0 for one per device
+    unsigned streams;
+    // primitives in the scene, see buildScene()
+    unsigned instances;
+    // rows per band frames are rendered and converted in on the device, 0 for whole frames, see recordBands()
+    uint32_t band;
+    // check the converters against each other instead of animating
+    Check check;
+    // write the RGBA pixels of every frame to output/, a debugging aid that slows rendering down, see saveRaw()
+    bool dumpRaw;
+    // directory to load the .spv files from instead of the SPIR-V embedded in the binary, NULL for the embedded
+    char const *shaders;
+    // absolute directory pipeline caches are kept in, "none" for no cache, NULL for the default, see
+    // pipelineCacheDirectory()
+    char const *cacheDir;
+} Options;
+
+/*
+ * The command buffers of one stage for every frame, recorded once at setup and resubmitted every frame, see
+ * recordCommands(). What changes from frame to frame goes through the frame's Transform and descriptor sets, never
+ * into a command buffer.
+ */
 typedef struct {
+    // one per frame, NULL for a stage the stream does not run
+    VkCommandBuffer *buffers;
+    // the render pass contents each render buffer executes, one per band of every frame, NULL for other stages
+    VkCommandBuffer *secondaries;
+} CommandSet;
+
+typedef struct Elham {
+    // NULL, or the stream whose instance, device, memory, pipelines and shaders this one borrows
+    struct Elham const *shared;
     VkInstance instance;
     VkPhysicalDevice gpu;
+    VkPhysicalDeviceType deviceType;
     uint32_t graphicsQueueFamilyIndex;
     VkDevice device;
     VkCommandPool commandPool;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    VkDeviceSize nonCoherentAtomSize;
+    // shared by every stream on the device
+    MemoryArena *arena;
 
     VkFormat format;
     uint32_t width;
     uint32_t height;
+    ColorFormat color;
 
     VkRenderPass renderPass;
-    VkImage srcImage;
-    VkDeviceMemory srcImageMemory;
-    VkImageView srcImageView;
-    VkFramebuffer framebuffer;
-    VkCommandBuffer renderCommandBuffer;
     VkPipelineLayout pipelineLayout;
     VkShaderModule vertShader;
     VkShaderModule fragShader;
     VkPipeline pipeline;
+    // every pipeline is created through this cache, loaded from and saved to pipelineCachePath unless that is NULL
+    VkPipelineCache pipelineCache;
+    char *pipelineCachePath;
+    // the pipeline cache was loaded from disk, so pipelines should not need to be compiled again
+    bool warmCache;
+    // extent of the render target and Y'CbCr planes, only a band of the frame's rows when bands > 1
     VkRect2D rect;
-    VkBuffer vertexBuffer;
-    size_t vertexCount;
-    VkDeviceMemory vertexBufferMemory;
-    VkImage dstImage;
-    VkDeviceMemory dstImageMemory;
-    VkCommandBuffer copyCommandBuffer;
+    // horizontal bands each frame is rendered, converted and read back in, see recordBands()
+    uint32_t bands;
+    // uploaded once, every frame draws the same scene through its own Transform
+    Scene scene;
+    VkDescriptorSetLayout transformLayout;
+    VkDescriptorPool transformPool;
+    // radians the vertices are rotated by about the origin
+    float angle;
     VkQueue graphicQueue;
-    VkFence renderFence;
-    VkFence copyFence;
     callback_t callback;
 
+    /*
+     * A frame is on the GPU for inFlight frames, then its planes are lent to the encoder for the frameCount - inFlight
+     * frames until it is rendered into again, see animate().
+     */
+    Frame *frames;
+    uint32_t frameCount;
+    uint32_t inFlight;
+    SyncMode sync;
+    // Y'CbCr reads the render target directly instead of a linear copy of it.
+    bool directInput;
+    // Y'CbCr planes live in device-local optimal images and are read back through one buffer.
+    bool deviceLocalPlanes;
+
     YCbCr ycbcr;
+    Encoder encoder;
+    // by Stage, only the render, copy and Y'CbCr stages record commands
+    CommandSet commands[STAGE_YCBCR + 1];
+
+    // per-stage timings, NULL unless benchmarking
+    Samples *stats;
+    bool timestamps;
+    double timestampPeriod;
+    uint64_t timestampMask;
+    // seconds the GPU spent on the stages of finished frames, from the timestamps
+    double gpuBusy;
 } Elham;
 
 
-uint32_t const width = 50;
-uint32_t const height = 50;
+// The vertices of every Shape, back to back.
+Vertex const meshVertices[] = {
+    {.pos = {-1.0f, -1.0f}, .color = {1.0f, 0.0f, 0.0f}},
+    {.pos = {1.0f, 1.0f}, .color = {0.0f, 1.0f, 0.0f}},
+    {.pos = {-1.0f, 1.0f}, .color = {0.0f, 0.0f, 1.0f}},
 
-Vertex vertices[] = {
     {.pos = {-1.0f, -1.0f}, .color = {1.0f, 0.0f, 0.0f}},
+    {.pos = {1.0f, -1.0f}, .color = {1.0f, 1.0f, 0.0f}},
     {.pos = {1.0f, 1.0f}, .color = {0.0f, 1.0f, 0.0f}},
     {.pos = {-1.0f, 1.0f}, .color = {0.0f, 0.0f, 1.0f}}
 };
 
-void rotateVec2(Vec2 center, float angle, Vec2 *p) {
-    float s = sinf(angle);
-    float c = cosf(angle);
+// Wound like the triangle, which the pipeline's culling keeps.
+uint16_t const meshIndices[] = {0, 1, 2, 0, 2, 3, 0, 1, 2};
+
+// Where each Shape is in meshIndices and meshVertices.
+struct {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    int32_t vertexOffset;
+} const meshes[SHAPE_COUNT] = {
+    [SHAPE_TRIANGLE] = {0, 3, 0},
+    [SHAPE_QUAD] = {3, 6, 3},
+};
 
-    // translate point back to origin:
-    p->x -= center.x;
-    p->y -= center.y;
+// Kr and Kb of each Matrix, Y' = Kr R' + (1 - Kr - Kb) G' + Kb B', and how x265 signals it in the VUI.
+struct {
+    char const *name;
+    double kr;
+    double kb;
+    char const *primaries;
+    char const *transfer;
+    char const *matrix;
+} const colorMatrices[] = {
+    [MATRIX_BT709] = {"709", 0.2126, 0.0722, "bt709", "bt709", "bt709"},
+    [MATRIX_BT601] = {"601", 0.299, 0.114, "smpte170m", "smpte170m", "smpte170m"},
+    [MATRIX_BT2020] = {"2020", 0.2627, 0.0593, "bt2020", "bt2020-10", "bt2020nc"},
+};
+
+/*
+ * Per PixelFormat, by how much the chroma planes are scaled down in x and y as a shift, and the x265 colour space of
+ * the pictures. x265 only takes planar input, so NV12 is split into I420 on the way into the encoder queue.
+ */
+struct {
+    char const *name;
+    uint32_t shiftX;
+    uint32_t shiftY;
+    bool interleaved;
+    int csp;
+} const pixelFormats[] = {
+    [FORMAT_I420] = {"i420", 1, 1, false, X265_CSP_I420},
+    [FORMAT_NV12] = {"nv12", 1, 1, true, X265_CSP_I420},
+    [FORMAT_I422] = {"i422", 1, 0, false, X265_CSP_I422},
+    [FORMAT_I444] = {"i444", 0, 0, false, X265_CSP_I444},
+};
 
-    // rotate point
-    float xnew = p->x * c - p->y * s;
-    float ynew = p->x * s + p->y * c;
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
 
-    // translate point back:
-    p->x = xnew + center.x;
-    p->y = ynew + center.y;
+void record(Samples *samples, double ms) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 256;
+        samples->values = realloc(samples->values, samples->capacity * sizeof(double));
+    }
+    samples->values[samples->count++] = ms;
 }
 
 void checkValidationLayerSupport(uint32_t *count, cstrarr_t *layers) {
@@ -199,8 +695,15 @@ void createInstance(Elham *e) {
     inf.pApplicationInfo = &app;
     inf.enabledExtensionCount = 0;
     inf.ppEnabledExtensionNames = NULL;
-    inf.enabledLayerCount = 1;
     char const *validations[] = {"VK_LAYER_KHRONOS_validation"}; //, "VK_LAYER_LUNARG_api_dump"};
+    // validation is skipped when the layer is not installed, and always when benchmarking
+#ifndef ELHAM_BENCH
+    for (uint32_t i = 0; i < validationLayerCount; i++) {
+        if (strcmp(validationLayers[i], validations[0]) == 0) {
+            inf.enabledLayerCount = 1;
+        }
+    }
+#endif
     inf.ppEnabledLayerNames = validations;
     if (vkCreateInstance(&inf, NULL, &instance) != VK_SUCCESS) {
         printf("failed.\n");
@@ -211,41 +714,199 @@ void createInstance(Elham *e) {
     e->instance = instance;
 }
 
-void pickPhysicalDevice(Elham *engine) {
+bool hasQueueFamily(VkPhysicalDevice gpu, VkQueueFlags bits) {
+    uint32_t count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &count, NULL);
+    VkQueueFamilyProperties *queueFamilies = malloc(count * sizeof(VkQueueFamilyProperties));
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &count, queueFamilies);
+    bool found = false;
+    for (uint32_t i = 0; i < count; i++) {
+        if ((queueFamilies[i].queueFlags & bits) == bits) {
+            found = true;
+        }
+    }
+    free(queueFamilies);
+    return found;
+}
+
+// Why a device can not run the configured pipeline, or NULL if it can.
+char const *unsuitableDevice(Elham const *e, VkPhysicalDevice gpu) {
+    if (!hasQueueFamily(gpu, VK_QUEUE_GRAPHICS_BIT) || !hasQueueFamily(gpu, VK_QUEUE_COMPUTE_BIT)) {
+        return "no graphics or compute queue";
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(gpu, &properties);
+    VkPhysicalDeviceLimits const *limits = &properties.limits;
+    VkExtent2D extent = e->rect.extent;
+    if (extent.width > limits->maxImageDimension2D || extent.height > limits->maxImageDimension2D ||
+        extent.width > limits->maxFramebufferWidth || extent.height > limits->maxFramebufferHeight) {
+        return e->bands > 1 ? "bands larger than its render targets"
+                            : "frames larger than its render targets, see --gpu-band";
+    }
+
+    VkFormatProperties rgba;
+    vkGetPhysicalDeviceFormatProperties(gpu, e->format, &rgba);
+    VkFormatFeatureFlags target = VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT | VK_FORMAT_FEATURE_TRANSFER_SRC_BIT;
+    if (e->directInput) {
+        target |= VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT;
+    }
+    if ((rgba.optimalTilingFeatures & target) != target) {
+        return "render target format not supported";
+    }
+    // the CPU converter only reads the copy on the host
+    VkFormatFeatureFlags copy = VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+    if (e->ycbcr.kernel != KERNEL_CPU) {
+        copy |= VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT;
+    }
+    if (!e->directInput && (rgba.linearTilingFeatures & copy) != copy) {
+        return e->ycbcr.kernel == KERNEL_CPU ? "no linear images to copy the render target into"
+                                             : "no linear storage images for the render target format";
+    }
+
+    if (e->ycbcr.kernel == KERNEL_PACKED || e->ycbcr.kernel == KERNEL_CPU) {
+        return NULL;
+    }
+    VkFormatProperties plane;
+    vkGetPhysicalDeviceFormatProperties(gpu, e->ycbcr.format, &plane);
+    VkFormatFeatureFlags planes = e->deviceLocalPlanes ? plane.optimalTilingFeatures : plane.linearTilingFeatures;
+    if (!(planes & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+        return e->deviceLocalPlanes ? "no storage images of the plane format"
+                                    : "no linear storage images of the plane format";
+    }
+    return NULL;
+}
+
+VkDeviceSize deviceLocalHeapSize(VkPhysicalDevice gpu) {
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties(gpu, &memProperties);
+    VkDeviceSize size = 0;
+    for (uint32_t i = 0; i < memProperties.memoryHeapCount; i++) {
+        if (memProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+            size += memProperties.memoryHeaps[i].size;
+        }
+    }
+    return size;
+}
+
+// Among suitable devices discrete beats integrated beats virtual beats CPU, then more device-local memory wins.
+uint64_t scoreDevice(VkPhysicalDevice gpu, VkPhysicalDeviceType type) {
+    uint64_t rank;
+    switch (type) {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: rank = 4; break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: rank = 3; break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: rank = 2; break;
+        case VK_PHYSICAL_DEVICE_TYPE_CPU: rank = 1; break;
+        default: rank = 0; break;
+    }
+    return (rank << 48) + (deviceLocalHeapSize(gpu) >> 20);
+}
+
+char const *deviceTypeName(VkPhysicalDeviceType type) {
+    switch (type) {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return "discrete";
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return "integrated";
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return "virtual";
+        case VK_PHYSICAL_DEVICE_TYPE_CPU: return "CPU";
+        default: return "other";
+    }
+}
+
+bool cpuConvertible(ColorFormat const *color) {
+    return color->depth == 8 && pixelFormats[color->format].shiftY == 1;
+}
+
+// Converts on the host from a linear RGBA copy of every frame instead of running a Y'CbCr kernel on the GPU.
+void useCpuKernel(Elham *e) {
+    e->ycbcr.kernel = KERNEL_CPU;
+    e->directInput = false;
+    // the CPU converter reads whole frames
+    e->bands = 1;
+    e->rect.extent.height = e->height;
+}
+
+// Switches to the CPU converter when no device can run the Y'CbCr kernel, true if the device list is worth another look.
+bool fallBackToCpu(Elham *e) {
+    if (e->ycbcr.kernel == KERNEL_CPU || !cpuConvertible(&e->color)) {
+        return false;
+    }
+    printf("Falling back to the CPU Y'CbCr converter.\n");
+    useCpuKernel(e);
+    return true;
+}
+
+/*
+ * Picks the best suitable device, see scoreDevice(). selection overrides the choice, either the number a device is
+ * listed with or part of its name.
+ */
+void pickPhysicalDevice(Elham *engine, char const *selection) {
     printf("Pick up a GPU...\n");
     VkInstance instance = engine->instance;
 
     VkPhysicalDevice gpu = VK_NULL_HANDLE;
+    uint64_t bestScore = 0;
     uint32_t deviceCount = 0;
     vkEnumeratePhysicalDevices(instance, &deviceCount, NULL);
     VkPhysicalDevice *devices = malloc(deviceCount * sizeof(VkPhysicalDevice));
     vkEnumeratePhysicalDevices(instance, &deviceCount, devices);
+
+    char *end = NULL;
+    unsigned long index = selection != NULL ? strtoul(selection, &end, 10) : 0;
+    bool byIndex = selection != NULL && *selection != '\0' && *end == '\0';
+
     printf("Physical devices:\n");
     for (int i = 0; i < deviceCount; i++) {
         VkPhysicalDeviceProperties deviceProperties;
         vkGetPhysicalDeviceProperties(devices[i], &deviceProperties);
-
-        VkPhysicalDeviceFeatures deviceFeatures;
-        vkGetPhysicalDeviceFeatures(devices[i], &deviceFeatures);
-
-        if (deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
-            gpu = devices[i];
-        }
+        char const *reason = unsuitableDevice(engine, devices[i]);
+        uint64_t score = scoreDevice(devices[i], deviceProperties.deviceType);
 
         printf(
-            "%02d %s %s\n",
+            "%02d %s (%s, %llu MiB device-local)%s%s\n",
             i + 1,
             deviceProperties.deviceName,
-            deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU ? "(Discrete)" : ""
+            deviceTypeName(deviceProperties.deviceType),
+            (unsigned long long) (deviceLocalHeapSize(devices[i]) >> 20),
+            reason ? ": " : "",
+            reason ? reason : ""
         );
+
+        if (selection != NULL) {
+            bool selected = byIndex ? index == (unsigned long) i + 1
+                                    : strstr(deviceProperties.deviceName, selection) != NULL;
+            if (selected && gpu == VK_NULL_HANDLE) {
+                if (reason != NULL) {
+                    printf("Selected device %s is unsuitable: %s.\n", deviceProperties.deviceName, reason);
+                    if (fallBackToCpu(engine)) {
+                        free(devices);
+                        pickPhysicalDevice(engine, selection);
+                        return;
+                    }
+                    exit(EXIT_FAILURE);
+                }
+                gpu = devices[i];
+            }
+        } else if (reason == NULL && (gpu == VK_NULL_HANDLE || score > bestScore)) {
+            gpu = devices[i];
+            bestScore = score;
+        }
+    }
+    free(devices);
+    if (gpu == VK_NULL_HANDLE && selection == NULL && fallBackToCpu(engine)) {
+        pickPhysicalDevice(engine, selection);
+        return;
     }
     if (gpu == VK_NULL_HANDLE) {
-        printf("failed.\n");
+        printf("failed%s%s.\n", selection ? ", no device matches " : "", selection ? selection : "");
         exit(EXIT_FAILURE);
     }
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(gpu, &properties);
+    printf("Using %s.\n", properties.deviceName);
     printf("done.\n");
 
     engine->gpu = gpu;
+    engine->deviceType = properties.deviceType;
 }
 
 uint32_t pickQueueFamily(VkPhysicalDevice gpu, VkQueueFlagBits bits) {
@@ -278,6 +939,64 @@ void pickComputeQueueFamily(Elham *e) {
     printf("done.\n");
 }
 
+void pickSyncMode(Elham *e) {
+    if (e->sync != SYNC_TIMELINE) {
+        return;
+    }
+
+    printf("Check timeline semaphore support...");
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(e->gpu, &properties);
+    VkPhysicalDeviceVulkan12Features features12 = {0};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    if (properties.apiVersion >= VK_API_VERSION_1_2) {
+        VkPhysicalDeviceFeatures2 features = {0};
+        features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features.pNext = &features12;
+        vkGetPhysicalDeviceFeatures2(e->gpu, &features);
+    }
+    if (!features12.timelineSemaphore) {
+        printf("not supported, falling back to fences.\n");
+        e->sync = SYNC_FENCES;
+        return;
+    }
+    printf("done.\n");
+}
+
+uint32_t timestampValidBits(VkPhysicalDevice gpu, uint32_t queueFamilyIndex) {
+    uint32_t count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &count, NULL);
+    VkQueueFamilyProperties *queueFamilies = malloc(count * sizeof(VkQueueFamilyProperties));
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &count, queueFamilies);
+    uint32_t bits = queueFamilies[queueFamilyIndex].timestampValidBits;
+    free(queueFamilies);
+    return bits;
+}
+
+/*
+ * GPU stages are timed whenever both the graphics and the compute queue can do it, the time the GPU was busy is
+ * reported per device from these timestamps, see reportDevices().
+ */
+void pickTimestamps(Elham *e) {
+    e->timestamps = false;
+    printf("Check timestamp support...");
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(e->gpu, &properties);
+    uint32_t bits = timestampValidBits(e->gpu, e->graphicsQueueFamilyIndex);
+    uint32_t computeBits = timestampValidBits(e->gpu, e->ycbcr.queueFamilyIndex);
+    if (computeBits < bits) {
+        bits = computeBits;
+    }
+    if (bits == 0) {
+        printf("not supported, GPU stages will not be timed.\n");
+        return;
+    }
+    e->timestamps = true;
+    e->timestampPeriod = properties.limits.timestampPeriod;
+    e->timestampMask = bits >= 64 ? UINT64_MAX : (UINT64_C(1) << bits) - 1;
+    printf("done.\n");
+}
+
 void createDevice(Elham *e) {
     VkPhysicalDevice gpu = e->gpu;
     uint32_t qfi = e->graphicsQueueFamilyIndex;
@@ -294,14 +1013,24 @@ void createDevice(Elham *e) {
     info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     info.pQueueCreateInfos = &queueInfo;
     info.queueCreateInfoCount = 1;
+    VkPhysicalDeviceFeatures supported;
+    vkGetPhysicalDeviceFeatures(gpu, &supported);
     VkPhysicalDeviceFeatures deviceFeatures = {0};
+    deviceFeatures.multiDrawIndirect = supported.multiDrawIndirect;
+    deviceFeatures.drawIndirectFirstInstance = supported.drawIndirectFirstInstance;
     info.pEnabledFeatures = &deviceFeatures;
+    VkPhysicalDeviceVulkan12Features features12 = {0};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    features12.timelineSemaphore = e->sync == SYNC_TIMELINE;
+    info.pNext = &features12;
     if (vkCreateDevice(gpu, &info, NULL, &device) != VK_SUCCESS) {
         printf("failed.\n");
         exit(EXIT_FAILURE);
     }
 
     e->device = device;
+    e->scene.multiDraw = supported.multiDrawIndirect;
+    e->scene.firstInstance = supported.drawIndirectFirstInstance;
     vkGetDeviceQueue(e->device, e->graphicsQueueFamilyIndex, 0, &e->graphicQueue);
     vkGetDeviceQueue(e->device, e->ycbcr.queueFamilyIndex, 0, &e->ycbcr.queue);
 
@@ -314,22 +1043,62 @@ void readFile(char const *fileName, const char **buffer, long *length) {
     long len;
 
     f = fopen(fileName, "rb");
-    fseek(f, 0, SEEK_END);
-    len = ftell(f);
+    if (f == NULL) {
+        printf("Failed to open %s.\n", fileName);
+        exit(EXIT_FAILURE);
+    }
+    if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0) {
+        printf("Failed to seek in %s.\n", fileName);
+        exit(EXIT_FAILURE);
+    }
     rewind(f);
 
-    buff = (char *) malloc(len * sizeof(char));
-    fread(buff, len, 1, f);
+    buff = (char *) malloc(len > 0 ? len : 1);
+    if (buff == NULL) {
+        printf("Out of memory reading %s.\n", fileName);
+        exit(EXIT_FAILURE);
+    }
+    if (len > 0 && fread(buff, len, 1, f) != 1) {
+        printf("Failed to read %s.\n", fileName);
+        exit(EXIT_FAILURE);
+    }
     fclose(f);
 
     *buffer = buff;
     *length = len;
 }
 
-VkShaderModule createShader(VkDevice device, char const *filename) {
-    char const *code;
-    long _size;
-    readFile(filename, &code, &_size);
+/*
+ * Creates a shader module from the SPIR-V the build embedded as name, see shaders.h, or from the file name in
+ * directory when one is given with --shaders.
+ */
+VkShaderModule createShader(VkDevice device, char const *directory, char const *name) {
+    char const *code = NULL;
+    long _size = 0;
+    char *loaded = NULL;
+    if (directory != NULL) {
+        size_t length = strlen(directory) + strlen(name) + 2;
+        char *path = malloc(length);
+        snprintf(path, length, "%s/%s", directory, name);
+        readFile(path, &code, &_size);
+        free(path);
+        loaded = (char *) code;
+    } else {
+        for (size_t i = 0; i < sizeof(embeddedShaders) / sizeof(embeddedShaders[0]); i++) {
+            if (strcmp(embeddedShaders[i].name, name) == 0) {
+                code = (char const *) embeddedShaders[i].code;
+                _size = (long) embeddedShaders[i].size;
+            }
+        }
+        if (code == NULL) {
+            printf("No shader %s in the binary.\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (_size == 0 || _size % 4 != 0) {
+        printf("%s is not SPIR-V.\n", name);
+        exit(EXIT_FAILURE);
+    }
 
     VkShaderModuleCreateInfo createInfo = {0};
     createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -337,8 +1106,10 @@ VkShaderModule createShader(VkDevice device, char const *filename) {
     createInfo.pCode = (const uint32_t *) code;
     VkShaderModule shaderModule;
     if (vkCreateShaderModule(device, &createInfo, NULL, &shaderModule) != VK_SUCCESS) {
-        printf("Failed to create shader module.");
+        printf("Failed to create shader module %s.\n", name);
+        exit(EXIT_FAILURE);
     }
+    free(loaded);
 
     return shaderModule;
 }
@@ -354,7 +1125,7 @@ void createRenderPass(Elham *e) {
     src.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
     src.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     src.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    src.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    src.finalLayout = e->directInput ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
 
     VkAttachmentReference srcRef = {0};
     srcRef.attachment = 0;
@@ -391,6 +1162,21 @@ void createRenderPass(Elham *e) {
     e->renderPass = renderPass;
 }
 
+// The Transform uniform of shader.vert.
+void createTransformLayout(Elham *e) {
+    VkDescriptorSetLayoutBinding transform = {0};
+    transform.binding = 0;
+    transform.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    transform.descriptorCount = 1;
+    transform.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    VkDescriptorSetLayoutCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    info.bindingCount = 1;
+    info.pBindings = &transform;
+    VK_CHECK_RESULT(vkCreateDescriptorSetLayout(e->device, &info, NULL, &e->transformLayout))
+}
+
 void createPipelineLayout(Elham *e) {
     VkDevice device = e->device;
 
@@ -398,10 +1184,12 @@ void createPipelineLayout(Elham *e) {
     VkPipelineLayout pipelineLayout;
     VkPipelineLayoutCreateInfo pipelineLayoutInfo = {0};
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 0;
-    pipelineLayoutInfo.pSetLayouts = NULL;
-    pipelineLayoutInfo.pushConstantRangeCount = 0;
-    pipelineLayoutInfo.pPushConstantRanges = NULL;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &e->transformLayout;
+    // the Band of shader.vert, see recordSceneCommands()
+    VkPushConstantRange band = {VK_SHADER_STAGE_VERTEX_BIT, 0, 2 * sizeof(float)};
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &band;
     if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, NULL, &pipelineLayout) != VK_SUCCESS) {
         printf("failed.\n");
         exit(EXIT_FAILURE);
@@ -411,6 +1199,191 @@ void createPipelineLayout(Elham *e) {
     e->pipelineLayout = pipelineLayout;
 }
 
+/*
+ * Written in front of the driver's pipeline cache data on disk. The data is only reused by the device and driver build
+ * that wrote it: the same vendor, device, driver version, device UUID and pipeline cache UUID.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t driverVersion;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint8_t deviceUUID[VK_UUID_SIZE];
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    uint64_t size;
+} PipelineCacheHeader;
+
+#define PIPELINE_CACHE_MAGIC 0x43504c45 // "ELPC"
+
+PipelineCacheHeader pipelineCacheHeader(VkPhysicalDevice gpu) {
+    VkPhysicalDeviceIDProperties ids = {0};
+    ids.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    VkPhysicalDeviceProperties2 properties = {0};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &ids;
+    vkGetPhysicalDeviceProperties2(gpu, &properties);
+
+    PipelineCacheHeader header = {0};
+    header.magic = PIPELINE_CACHE_MAGIC;
+    header.driverVersion = properties.properties.driverVersion;
+    header.vendorID = properties.properties.vendorID;
+    header.deviceID = properties.properties.deviceID;
+    memcpy(header.deviceUUID, ids.deviceUUID, VK_UUID_SIZE);
+    memcpy(header.pipelineCacheUUID, properties.properties.pipelineCacheUUID, VK_UUID_SIZE);
+    return header;
+}
+
+/*
+ * The directory pipeline caches are kept in, created if need be: directory, else PIPELINE_CACHE, else
+ * $XDG_CACHE_HOME/elham or ~/.cache/elham. NULL when it is "none" or no absolute directory can be made.
+ */
+char *pipelineCacheDirectory(char const *directory) {
+    if (directory == NULL || *directory == '\0') {
+        directory = PIPELINE_CACHE;
+    }
+    if (strcmp(directory, "none") == 0) {
+        return NULL;
+    }
+    char *path;
+    if (*directory != '\0') {
+        path = strdup(directory);
+    } else {
+        char const *base = getenv("XDG_CACHE_HOME");
+        char const *suffix = "/elham";
+        if (base == NULL || base[0] != '/') {
+            base = getenv("HOME");
+            suffix = "/.cache/elham";
+        }
+        if (base == NULL || base[0] != '/') {
+            printf("Neither XDG_CACHE_HOME nor HOME is an absolute path, not caching pipelines.\n");
+            return NULL;
+        }
+        size_t length = strlen(base) + strlen(suffix) + 1;
+        path = malloc(length);
+        snprintf(path, length, "%s%s", base, suffix);
+    }
+    if (path[0] != '/') {
+        printf("The pipeline cache directory %s is not absolute, not caching pipelines.\n", path);
+        free(path);
+        return NULL;
+    }
+    // every missing directory on the way, like mkdir -p
+    for (char *c = path + 1;; c++) {
+        if (*c != '/' && *c != '\0') {
+            continue;
+        }
+        char end = *c;
+        *c = '\0';
+        bool made = mkdir(path, 0755) == 0 || errno == EEXIST;
+        *c = end;
+        if (!made) {
+            printf("Failed to create %s, not caching pipelines.\n", path);
+            free(path);
+            return NULL;
+        }
+        if (end == '\0') {
+            return path;
+        }
+    }
+}
+
+/*
+ * Creates the pipeline cache, seeded from DIRECTORY/pipelines-VENDOR-DEVICE-UUID.cache when that was written by this
+ * device and driver, see pipelineCacheDirectory(). The device UUID in the name keeps identical GPUs in one box from
+ * overwriting each other's cache. A missing, stale or damaged file only means the pipelines are compiled from SPIR-V
+ * again.
+ */
+void createPipelineCache(Elham *e, char const *directory) {
+    PipelineCacheHeader expected = pipelineCacheHeader(e->gpu);
+    char *cacheDirectory = pipelineCacheDirectory(directory);
+    e->pipelineCachePath = NULL;
+    e->warmCache = false;
+    if (cacheDirectory != NULL) {
+        char uuid[2 * VK_UUID_SIZE + 1];
+        for (int i = 0; i < VK_UUID_SIZE; i++) {
+            snprintf(uuid + 2 * i, 3, "%02x", expected.deviceUUID[i]);
+        }
+        size_t length = strlen(cacheDirectory) + sizeof(uuid) + 32;
+        e->pipelineCachePath = malloc(length);
+        snprintf(e->pipelineCachePath, length, "%s/pipelines-%04x-%04x-%s.cache", cacheDirectory, expected.vendorID,
+                 expected.deviceID, uuid);
+        free(cacheDirectory);
+    }
+    printf("Create pipeline cache...");
+
+    void *data = NULL;
+    PipelineCacheHeader header = {0};
+    FILE *f = e->pipelineCachePath != NULL ? fopen(e->pipelineCachePath, "rb") : NULL;
+    if (f != NULL) {
+        if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == expected.magic &&
+            header.driverVersion == expected.driverVersion && header.vendorID == expected.vendorID &&
+            header.deviceID == expected.deviceID &&
+            memcmp(header.deviceUUID, expected.deviceUUID, VK_UUID_SIZE) == 0 &&
+            memcmp(header.pipelineCacheUUID, expected.pipelineCacheUUID, VK_UUID_SIZE) == 0 &&
+            header.size > 0 && header.size <= ((uint64_t) 1 << 30)) {
+            data = malloc(header.size);
+            if (fread(data, header.size, 1, f) != 1) {
+                free(data);
+                data = NULL;
+            }
+        }
+        fclose(f);
+    }
+
+    VkPipelineCacheCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    info.initialDataSize = data != NULL ? header.size : 0;
+    info.pInitialData = data;
+    if (vkCreatePipelineCache(e->device, &info, NULL, &e->pipelineCache) != VK_SUCCESS) {
+        // the driver refused the data after all, start empty
+        info.initialDataSize = 0;
+        info.pInitialData = NULL;
+        free(data);
+        data = NULL;
+        VK_CHECK_RESULT(vkCreatePipelineCache(e->device, &info, NULL, &e->pipelineCache))
+    }
+    e->warmCache = data != NULL;
+    free(data);
+    if (e->warmCache) {
+        printf("done, %llu KiB from %s.\n", (unsigned long long) (header.size >> 10), e->pipelineCachePath);
+    } else {
+        printf("done, empty.\n");
+    }
+}
+
+/*
+ * Saves the pipeline cache for the next run. It goes to a temporary file first and is renamed over the old one, so
+ * processes starting at the same time never read half a cache.
+ */
+void savePipelineCache(Elham *e) {
+    if (e->pipelineCachePath == NULL) {
+        return;
+    }
+    PipelineCacheHeader header = pipelineCacheHeader(e->gpu);
+    size_t size = 0;
+    VK_CHECK_RESULT(vkGetPipelineCacheData(e->device, e->pipelineCache, &size, NULL))
+    void *data = malloc(size);
+    VK_CHECK_RESULT(vkGetPipelineCacheData(e->device, e->pipelineCache, &size, data))
+    header.size = size;
+
+    size_t length = strlen(e->pipelineCachePath) + 32;
+    char *temporary = malloc(length);
+    snprintf(temporary, length, "%s.%ld", e->pipelineCachePath, (long) getpid());
+    FILE *f = fopen(temporary, "wb");
+    if (f == NULL) {
+        printf("Failed to save the pipeline cache to %s.\n", temporary);
+    } else {
+        bool written = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(data, size, 1, f) == 1;
+        written = fclose(f) == 0 && written;
+        if (!written || rename(temporary, e->pipelineCachePath) != 0) {
+            printf("Failed to save the pipeline cache to %s.\n", e->pipelineCachePath);
+            remove(temporary);
+        }
+    }
+    free(temporary);
+    free(data);
+}
+
 void createPipeline(Elham *e) {
     VkDevice device = e->device;
     VkShaderModule vertShader = e->vertShader;
@@ -432,12 +1405,16 @@ void createPipeline(Elham *e) {
     fragShaderStageInfo.pName = "main";
     VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
 
-    VkVertexInputBindingDescription vertBindDesc = {0};
-    vertBindDesc.binding = 0;
-    vertBindDesc.stride = sizeof(Vertex);
-    vertBindDesc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    // mesh vertices, and the Instance each draw steps through
+    VkVertexInputBindingDescription vertBindDesc[2] = {0};
+    vertBindDesc[0].binding = 0;
+    vertBindDesc[0].stride = sizeof(Vertex);
+    vertBindDesc[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    vertBindDesc[1].binding = 1;
+    vertBindDesc[1].stride = sizeof(Instance);
+    vertBindDesc[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
 
-    VkVertexInputAttributeDescription vertAttrDesc[2] = {}; //malloc(2 * sizeof(VkVertexInputAttributeDescription));
+    VkVertexInputAttributeDescription vertAttrDesc[5] = {0};
     vertAttrDesc[0].binding = 0;
     vertAttrDesc[0].location = 0;
     vertAttrDesc[0].format = VK_FORMAT_R32G32_SFLOAT;
@@ -448,11 +1425,26 @@ void createPipeline(Elham *e) {
     vertAttrDesc[1].format = VK_FORMAT_R32G32B32_SFLOAT;
     vertAttrDesc[1].offset = offsetof(Vertex, color);
 
+    vertAttrDesc[2].binding = 1;
+    vertAttrDesc[2].location = 2;
+    vertAttrDesc[2].format = VK_FORMAT_R32G32_SFLOAT;
+    vertAttrDesc[2].offset = offsetof(Instance, offset);
+
+    vertAttrDesc[3].binding = 1;
+    vertAttrDesc[3].location = 3;
+    vertAttrDesc[3].format = VK_FORMAT_R32G32_SFLOAT;
+    vertAttrDesc[3].offset = offsetof(Instance, scale);
+
+    vertAttrDesc[4].binding = 1;
+    vertAttrDesc[4].location = 4;
+    vertAttrDesc[4].format = VK_FORMAT_R32G32B32_SFLOAT;
+    vertAttrDesc[4].offset = offsetof(Instance, tint);
+
     VkPipelineVertexInputStateCreateInfo vertexInputInfo = {0};
     vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputInfo.vertexBindingDescriptionCount = 1;
-    vertexInputInfo.pVertexBindingDescriptions = &vertBindDesc;
-    vertexInputInfo.vertexAttributeDescriptionCount = 2;
+    vertexInputInfo.vertexBindingDescriptionCount = 2;
+    vertexInputInfo.pVertexBindingDescriptions = vertBindDesc;
+    vertexInputInfo.vertexAttributeDescriptionCount = 5;
     vertexInputInfo.pVertexAttributeDescriptions = vertAttrDesc;
 
     VkPipelineInputAssemblyStateCreateInfo inputAssembly = {0};
@@ -539,7 +1531,7 @@ void createPipeline(Elham *e) {
     pipelineInfo.basePipelineIndex = -1;
 
     VkPipeline pipeline;
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, NULL, &pipeline) != VK_SUCCESS) {
+    if (vkCreateGraphicsPipelines(device, e->pipelineCache, 1, &pipelineInfo, NULL, &pipeline) != VK_SUCCESS) {
         printf("failed.\n");
         exit(EXIT_FAILURE);
     }
@@ -548,9 +1540,9 @@ void createPipeline(Elham *e) {
     e->pipeline = pipeline;
 }
 
-void createImageView(Elham *e) {
+void createImageView(Elham *e, Frame *f) {
     VkDevice device = e->device;
-    VkImage image = e->srcImage;
+    VkImage image = f->srcImage;
     VkFormat format = e->format;
 
     VkImageView imageView;
@@ -573,12 +1565,12 @@ void createImageView(Elham *e) {
         printf("failed.\n");
     }
     printf("done.\n");
-    e->srcImageView = imageView;
+    f->srcImageView = imageView;
 }
 
-void createYImageView(Elham *e) {
+void createYImageView(Elham *e, Frame *f) {
     VkDevice device = e->device;
-    VkImage image = e->ycbcr.y;
+    VkImage image = f->ycbcr.y;
     VkFormat format = e->ycbcr.format;
 
     VkImageView view;
@@ -598,12 +1590,12 @@ void createYImageView(Elham *e) {
         printf("failed.\n");
     }
     printf("done.\n");
-    e->ycbcr.yView = view;
+    f->ycbcr.yView = view;
 }
 
-void createCbImageView(Elham *e) {
+void createCbImageView(Elham *e, Frame *f) {
     VkDevice device = e->device;
-    VkImage image = e->ycbcr.cb;
+    VkImage image = f->ycbcr.cb;
     VkFormat format = e->ycbcr.format;
 
     VkImageView view;
@@ -623,12 +1615,12 @@ void createCbImageView(Elham *e) {
         printf("failed.\n");
     }
     printf("done.\n");
-    e->ycbcr.cbView = view;
+    f->ycbcr.cbView = view;
 }
 
-void createCrImageView(Elham *e) {
+void createCrImageView(Elham *e, Frame *f) {
     VkDevice device = e->device;
-    VkImage image = e->ycbcr.cr;
+    VkImage image = f->ycbcr.cr;
     VkFormat format = e->ycbcr.format;
 
     VkImageView view;
@@ -648,12 +1640,12 @@ void createCrImageView(Elham *e) {
         printf("failed.\n");
     }
     printf("done.\n");
-    e->ycbcr.crView = view;
+    f->ycbcr.crView = view;
 }
 
-void createInImageView(Elham *e) {
+void createInImageView(Elham *e, Frame *f) {
     VkDevice device = e->device;
-    VkImage image = e->dstImage;
+    VkImage image = e->directInput ? f->srcImage : f->dstImage;
     VkFormat format = e->format;
 
     VkImageView view;
@@ -676,10 +1668,10 @@ void createInImageView(Elham *e) {
         printf("failed.\n");
     }
     printf("done.\n");
-    e->ycbcr.inputView = view;
+    f->ycbcr.inputView = view;
 }
 
-void createFramebuffer(Elham *e) {
+void createFramebuffer(Elham *e, Frame *f) {
     VkDevice device = e->device;
     VkRenderPass renderPass = e->renderPass;
 
@@ -690,16 +1682,16 @@ void createFramebuffer(Elham *e) {
     framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
     framebufferInfo.renderPass = renderPass;
     framebufferInfo.attachmentCount = 1;
-    framebufferInfo.pAttachments = &e->srcImageView;
-    framebufferInfo.width = e->width;
-    framebufferInfo.height = e->height;
+    framebufferInfo.pAttachments = &f->srcImageView;
+    framebufferInfo.width = e->rect.extent.width;
+    framebufferInfo.height = e->rect.extent.height;
     framebufferInfo.layers = 1;
 
     if (vkCreateFramebuffer(device, &framebufferInfo, NULL, &framebuffer) != VK_SUCCESS) {
         printf("Failed.\n");
     }
 
-    e->framebuffer = framebuffer;
+    f->framebuffer = framebuffer;
     printf("done.\n");
 }
 
@@ -717,71 +1709,263 @@ uint32_t findMemoryType(VkPhysicalDevice gpu, uint32_t typeFilter, VkMemoryPrope
     exit(EXIT_FAILURE);
 }
 
-void createSrcImage(Elham *e) {
-    VkPhysicalDevice gpu = e->gpu;
-    VkDevice device = e->device;
-    VkFormat format = e->format;
+uint32_t findMemoryTypePreferred(VkPhysicalDevice gpu, uint32_t typeFilter, VkMemoryPropertyFlags required,
+                                 VkMemoryPropertyFlags preferred) {
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties(gpu, &memProperties);
 
-    printf("Create source image...");
-    VkFormatProperties formatProperties;
-    vkGetPhysicalDeviceFormatProperties(gpu, format, &formatProperties);
-    if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_TRANSFER_SRC_BIT)) {
-        printf("Can not copy from a non-linear image\n.");
-        exit(EXIT_FAILURE);
-    }
-    if (!(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT)) {
-        printf("(Can not use a non-linear image as color attachment) ");
+    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+        VkMemoryPropertyFlags flags = memProperties.memoryTypes[i].propertyFlags;
+        if ((typeFilter & (1 << i)) && (flags & (required | preferred)) == (required | preferred)) {
+            return i;
+        }
     }
 
-    VkImageCreateInfo imageInfo = {0};
-    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    imageInfo.imageType = VK_IMAGE_TYPE_2D;
-    imageInfo.format = format;
-    imageInfo.extent.width = e->width;
-    imageInfo.extent.height = e->height;
-    imageInfo.extent.depth = 1;
-    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    imageInfo.mipLevels = 1;
-    imageInfo.arrayLayers = 1;
-    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
-    VkImage _image;
-    if (vkCreateImage(device, &imageInfo, NULL, &_image) != VK_SUCCESS) {
-        printf("failed.\n");
+    return findMemoryType(gpu, typeFilter, required);
+}
+
+VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+void createMemoryArena(Elham *e) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(e->gpu, &properties);
+    vkGetPhysicalDeviceMemoryProperties(e->gpu, &e->memoryProperties);
+    e->nonCoherentAtomSize = properties.limits.nonCoherentAtomSize;
+
+    e->arena = calloc(1, sizeof(MemoryArena));
+    e->arena->blockSize = (VkDeviceSize) MEMORY_BLOCK_SIZE << 20;
+    e->arena->granularity = properties.limits.bufferImageGranularity;
+    e->arena->maxBlocks = properties.limits.maxMemoryAllocationCount;
+}
+
+MemoryBlock *createMemoryBlock(Elham *e, uint32_t memoryTypeIndex, VkDeviceSize size) {
+    MemoryArena *arena = e->arena;
+    if (arena->blockCount == arena->maxBlocks) {
+        printf("Out of memory allocations (%u).\n", arena->maxBlocks);
         exit(EXIT_FAILURE);
     }
-    printf("done.\n");
 
-    printf("Allocating memory for source image...");
-    VkMemoryRequirements memRequirements;
-    vkGetImageMemoryRequirements(device, _image, &memRequirements);
-    VkMemoryAllocateInfo allocInfo = {0};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(gpu, memRequirements.memoryTypeBits,
-                                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    VkDeviceMemory _mem;
-    if (vkAllocateMemory(device, &allocInfo, NULL, &_mem) != VK_SUCCESS) {
-        printf("failed.\n");
+    MemoryBlock *block = calloc(1, sizeof(MemoryBlock));
+    block->memoryTypeIndex = memoryTypeIndex;
+    block->size = size;
+
+    VkMemoryAllocateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    info.allocationSize = size;
+    info.memoryTypeIndex = memoryTypeIndex;
+    if (vkAllocateMemory(e->device, &info, NULL, &block->memory) != VK_SUCCESS) {
+        printf("Failed to allocate memory.\n");
         exit(EXIT_FAILURE);
     }
-    printf("done.\n");
+    if (e->memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        VK_CHECK_RESULT(vkMapMemory(e->device, block->memory, 0, VK_WHOLE_SIZE, 0, (void **) &block->data))
+    }
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->blockCount++;
+    arena->reserved += size;
+    return block;
+}
 
-    vkBindImageMemory(device, _image, _mem, 0);
+// Where a resource would go in a block, or false if it does not fit.
+bool placeInBlock(Elham const *e, MemoryBlock const *block, VkMemoryRequirements req, bool linear,
+                  VkDeviceSize *offset) {
+    VkDeviceSize alignment = req.alignment;
+    VkMemoryPropertyFlags flags = e->memoryProperties.memoryTypes[block->memoryTypeIndex].propertyFlags;
+    // keep flushes and invalidates of one resource from touching its neighbours
+    if ((flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !(flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) &&
+        e->nonCoherentAtomSize > alignment) {
+        alignment = e->nonCoherentAtomSize;
+    }
+    // linear and optimal resources must not share a bufferImageGranularity page
+    if (block->used > 0 && block->lastLinear != linear && e->arena->granularity > alignment) {
+        alignment = e->arena->granularity;
+    }
 
-    e->srcImage = _image;
-    e->srcImageMemory = _mem;
+    *offset = alignUp(block->used, alignment);
+    return *offset + req.size <= block->size;
 }
 
-void createCommandPool(Elham *e) {
-    VkDevice device = e->device;
-    uint32_t qfi = e->graphicsQueueFamilyIndex;
+void allocate(Elham *e, VkMemoryRequirements req, bool linear, VkMemoryPropertyFlags required,
+              VkMemoryPropertyFlags preferred, Allocation *a) {
+    MemoryArena *arena = e->arena;
+    uint32_t memoryTypeIndex = findMemoryTypePreferred(e->gpu, req.memoryTypeBits, required, preferred);
 
-    printf("Create command pool...");
-    VkCommandPool commandPool;
-    VkCommandPoolCreateInfo info = {0};
+    MemoryBlock *block;
+    VkDeviceSize offset = 0;
+    for (block = arena->blocks; block != NULL; block = block->next) {
+        if (block->memoryTypeIndex == memoryTypeIndex && placeInBlock(e, block, req, linear, &offset)) {
+            break;
+        }
+    }
+    if (block == NULL) {
+        // resources larger than a block get a block of their own
+        block = createMemoryBlock(e, memoryTypeIndex, req.size > arena->blockSize ? req.size : arena->blockSize);
+    }
+
+    block->used = offset + req.size;
+    block->live++;
+    block->lastLinear = linear;
+
+    arena->allocationCount++;
+    arena->inUse += req.size;
+    if (arena->inUse > arena->peakInUse) {
+        arena->peakInUse = arena->inUse;
+    }
+
+    a->block = block;
+    a->memory = block->memory;
+    a->offset = offset;
+    a->size = req.size;
+    a->memorySize = block->size;
+    a->flags = e->memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags;
+    a->data = block->data != NULL ? block->data + offset : NULL;
+    memset(&a->layout, 0, sizeof(a->layout));
+}
+
+void allocateImage(Elham *e, VkImage image, VkImageTiling tiling, VkMemoryPropertyFlags required,
+                   VkMemoryPropertyFlags preferred, Allocation *a) {
+    VkMemoryRequirements req;
+    vkGetImageMemoryRequirements(e->device, image, &req);
+    allocate(e, req, tiling == VK_IMAGE_TILING_LINEAR, required, preferred, a);
+    VK_CHECK_RESULT(vkBindImageMemory(e->device, image, a->memory, a->offset))
+
+    if (tiling == VK_IMAGE_TILING_LINEAR) {
+        VkImageSubresource subResource = {0};
+        subResource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        vkGetImageSubresourceLayout(e->device, image, &subResource, &a->layout);
+    }
+}
+
+void allocateBuffer(Elham *e, VkBuffer buffer, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+                    Allocation *a) {
+    VkMemoryRequirements req;
+    vkGetBufferMemoryRequirements(e->device, buffer, &req);
+    allocate(e, req, true, required, preferred, a);
+    VK_CHECK_RESULT(vkBindBufferMemory(e->device, buffer, a->memory, a->offset))
+}
+
+void freeAllocation(Elham *e, Allocation *a) {
+    MemoryBlock *block = a->block;
+    if (block == NULL) {
+        return;
+    }
+    e->arena->allocationCount--;
+    e->arena->inUse -= a->size;
+    if (--block->live == 0) {
+        block->used = 0;
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+void destroyMemoryArena(Elham *e) {
+    MemoryArena *arena = e->arena;
+    while (arena->blocks != NULL) {
+        MemoryBlock *block = arena->blocks;
+        arena->blocks = block->next;
+        if (block->data != NULL) {
+            vkUnmapMemory(e->device, block->memory);
+        }
+        vkFreeMemory(e->device, block->memory, NULL);
+        free(block);
+    }
+    free(arena);
+    e->arena = NULL;
+}
+
+// The range of a non-coherent allocation to flush or invalidate, widened to nonCoherentAtomSize.
+VkMappedMemoryRange mappedRange(Elham const *e, Allocation const *a) {
+    VkDeviceSize atom = e->nonCoherentAtomSize;
+    VkDeviceSize start = a->offset / atom * atom;
+    VkDeviceSize end = (a->offset + a->size + atom - 1) / atom * atom;
+
+    VkMappedMemoryRange range = {0};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = a->memory;
+    range.offset = start;
+    range.size = end > a->memorySize ? VK_WHOLE_SIZE : end - start;
+    return range;
+}
+
+// Makes host writes visible to the device.
+void flushAllocation(Elham *e, Allocation const *a) {
+    if (a->flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) {
+        return;
+    }
+    VkMappedMemoryRange range = mappedRange(e, a);
+    VK_CHECK_RESULT(vkFlushMappedMemoryRanges(e->device, 1, &range))
+}
+
+// Makes device writes visible to the host.
+void invalidateAllocation(Elham *e, Allocation const *a) {
+    if (a->flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) {
+        return;
+    }
+    VkMappedMemoryRange range = mappedRange(e, a);
+    VK_CHECK_RESULT(vkInvalidateMappedMemoryRanges(e->device, 1, &range))
+}
+
+void createSrcImage(Elham *e, Frame *f) {
+    VkPhysicalDevice gpu = e->gpu;
+    VkDevice device = e->device;
+    VkFormat format = e->format;
+
+    printf("Create source image...");
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(gpu, format, &formatProperties);
+    if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_TRANSFER_SRC_BIT)) {
+        printf("Can not copy from a non-linear image\n.");
+        exit(EXIT_FAILURE);
+    }
+    if (e->directInput && !(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+        printf("Can not pass a non-linear image to compute shader.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT)) {
+        printf("(Can not use a non-linear image as color attachment) ");
+    }
+
+    VkImageCreateInfo imageInfo = {0};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent.width = e->rect.extent.width;
+    imageInfo.extent.height = e->rect.extent.height;
+    imageInfo.extent.depth = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    if (e->directInput) {
+        imageInfo.usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+    }
+    VkImage _image;
+    if (vkCreateImage(device, &imageInfo, NULL, &_image) != VK_SUCCESS) {
+        printf("failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("done.\n");
+
+    printf("Allocating memory for source image...");
+    allocateImage(e, _image, imageInfo.tiling, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &f->srcImageMemory);
+    printf("done.\n");
+
+    f->srcImage = _image;
+}
+
+void createCommandPool(Elham *e) {
+    VkDevice device = e->device;
+    uint32_t qfi = e->graphicsQueueFamilyIndex;
+
+    printf("Create command pool...");
+    VkCommandPool commandPool;
+    VkCommandPoolCreateInfo info = {0};
     info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     info.queueFamilyIndex = qfi;
     info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // =0
@@ -826,103 +2010,170 @@ void insertImageMemoryBarrier(
 }
 
 
-void createCommandBuffer(Elham *e) {
-    VkDevice device = e->device;
-    VkCommandPool commandPool = e->commandPool;
+void createQueryPool(Elham *e, Frame *f) {
+    f->queries = VK_NULL_HANDLE;
+    if (!e->timestamps) {
+        return;
+    }
 
-    printf("Create command buffer...");
-    VkCommandBuffer buffer;
-    VkCommandBufferAllocateInfo info = {0};
-    info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    info.commandPool = commandPool;
-    info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    info.commandBufferCount = 1;
+    VkQueryPoolCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    info.queryCount = 2 * GPU_STAGE_COUNT * e->bands;
+    VK_CHECK_RESULT(vkCreateQueryPool(e->device, &info, NULL, &f->queries))
+}
 
-    if (vkAllocateCommandBuffers(device, &info, &buffer) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
+// The first of the pair of queries timing stage of band, every band has a pair for every GPU stage.
+uint32_t timestampQuery(Stage stage, uint32_t band) {
+    return 2 * (band * GPU_STAGE_COUNT + stage);
+}
+
+// Command buffers are recorded once and resubmitted every frame, so each stage resets its own pair of queries.
+void beginTimestamp(Elham const *e, Frame const *f, VkCommandBuffer buffer, Stage stage, uint32_t band) {
+    if (!e->timestamps) {
+        return;
     }
-    printf("done.\n");
-    e->renderCommandBuffer = buffer;
+    vkCmdResetQueryPool(buffer, f->queries, timestampQuery(stage, band), 2);
+    vkCmdWriteTimestamp(buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, f->queries, timestampQuery(stage, band));
 }
 
-void createCopyCommandBuffer(Elham *e) {
-    VkDevice device = e->device;
-    VkCommandPool commandPool = e->commandPool;
+void endTimestamp(Elham const *e, Frame const *f, VkCommandBuffer buffer, Stage stage, uint32_t band) {
+    if (!e->timestamps) {
+        return;
+    }
+    vkCmdWriteTimestamp(buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, f->queries, timestampQuery(stage, band) + 1);
+}
 
-    printf("Create command buffer...");
-    VkCommandBuffer buffer;
-    VkCommandBufferAllocateInfo allocInfo = {0};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.commandPool = commandPool;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandBufferCount = 1;
+/*
+ * Records how long each GPU stage of a finished frame took, and adds it to the time the GPU was busy. A banded stage
+ * took as long as it did for all bands together.
+ */
+void collectTimestamps(Elham *e, Frame *f) {
+    if (!e->timestamps) {
+        return;
+    }
+    for (Stage stage = 0; stage < GPU_STAGE_COUNT; stage++) {
+        bool readback = e->deviceLocalPlanes && e->ycbcr.kernel == KERNEL_IMAGE;
+        if ((stage == STAGE_COPY && e->directInput) || (stage == STAGE_READBACK && !readback) ||
+            (stage == STAGE_YCBCR && e->ycbcr.kernel == KERNEL_CPU)) {
+            continue;
+        }
+        uint64_t elapsed = 0;
+        for (uint32_t band = 0; band < e->bands; band++) {
+            uint64_t ticks[2];
+            VK_CHECK_RESULT(vkGetQueryPoolResults(e->device, f->queries, timestampQuery(stage, band), 2,
+                                                  sizeof(ticks), ticks, sizeof(uint64_t),
+                                                  VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT))
+            elapsed += (ticks[1] - ticks[0]) & e->timestampMask;
+        }
+        e->gpuBusy += elapsed * e->timestampPeriod / 1e9;
+        if (e->stats != NULL) {
+            record(e->stats + stage, elapsed * e->timestampPeriod / 1e6);
+        }
+    }
+}
 
-    if (vkAllocateCommandBuffers(device, &allocInfo, &buffer) != VK_SUCCESS) {
-        printf("failed.\n");
+VkCommandBuffer *allocateCommandBuffers(Elham *e, VkCommandPool pool, VkCommandBufferLevel level, uint32_t count) {
+    VkCommandBuffer *buffers = calloc(count, sizeof(VkCommandBuffer));
+    VkCommandBufferAllocateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    info.commandPool = pool;
+    info.level = level;
+    info.commandBufferCount = count;
+    if (vkAllocateCommandBuffers(e->device, &info, buffers) != VK_SUCCESS) {
+        printf("failed to allocate command buffers.\n");
         exit(EXIT_FAILURE);
     }
-    printf("done.\n");
-    e->copyCommandBuffer = buffer;
+    return buffers;
 }
 
-void recordRenderCommands(Elham *e) {
-    VkCommandBuffer buffer = e->renderCommandBuffer;
-    VkRenderPass renderPass = e->renderPass;
-    VkRect2D rect = e->rect;
-    VkPipeline pipeline = e->pipeline;
-    VkFramebuffer framebuffer = e->framebuffer;
-    size_t vertexCount = e->vertexCount;
-    VkBuffer vertexBuffer = e->vertexBuffer;
-
-    printf("Begin command buffer...");
+/*
+ * The draws of a frame's render pass for one band of its rows, for its render commands to execute. Clip space is
+ * stretched so that the band's rows fill the render target: band b of n covers y from 2b / n - 1 to 2(b + 1) / n - 1.
+ */
+void recordSceneCommands(Elham *e, Frame *f, VkCommandBuffer buffer, uint32_t band) {
+    Scene const *scene = &e->scene;
+
+    VkCommandBufferInheritanceInfo inheritance = {0};
+    inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance.renderPass = e->renderPass;
+    inheritance.subpass = 0;
+    inheritance.framebuffer = f->framebuffer;
     VkCommandBufferBeginInfo info = {0};
     info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    info.flags = 0;
-    info.pInheritanceInfo = NULL;
-    if (vkBeginCommandBuffer(buffer, &info) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
+    info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    info.pInheritanceInfo = &inheritance;
+    VK_CHECK_RESULT(vkBeginCommandBuffer(buffer, &info))
+
+    vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, e->pipeline);
+    vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, e->pipelineLayout, 0, 1, &f->transformSet, 0,
+                            NULL);
+    float stretch[2] = {(float) e->bands, (float) e->bands - 2.0f * (float) band - 1.0f};
+    vkCmdPushConstants(buffer, e->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(stretch), stretch);
+    VkBuffer vertexBuffers[] = {scene->vertices, scene->instances};
+    VkDeviceSize offsets[] = {0, 0};
+    vkCmdBindVertexBuffers(buffer, 0, 2, vertexBuffers, offsets);
+    vkCmdBindIndexBuffer(buffer, scene->indices, 0, VK_INDEX_TYPE_UINT16);
+    uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+    if (scene->firstInstance && scene->multiDraw) {
+        vkCmdDrawIndexedIndirect(buffer, scene->draws, 0, scene->drawCount, stride);
+    } else {
+        for (uint32_t i = 0; i < scene->drawCount; i++) {
+            VkDrawIndexedIndirectCommand const *c = scene->commands + i;
+            if (scene->firstInstance) {
+                vkCmdDrawIndexedIndirect(buffer, scene->draws, i * stride, 1, stride);
+            } else {
+                vkCmdDrawIndexed(buffer, c->indexCount, c->instanceCount, c->firstIndex, c->vertexOffset,
+                                 c->firstInstance);
+            }
+        }
     }
-    printf("done.\n");
+    VK_CHECK_RESULT(vkEndCommandBuffer(buffer))
+}
 
-    printf("Recording commands...");
+// Clears the frame's render target and executes scene, its draws.
+void recordRenderPass(Elham *e, Frame *f, VkCommandBuffer buffer, VkCommandBuffer scene) {
     VkRenderPassBeginInfo renderPassInfo = {0};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    renderPassInfo.renderPass = renderPass;
-    renderPassInfo.framebuffer = framebuffer;
-    renderPassInfo.renderArea = rect;
+    renderPassInfo.renderPass = e->renderPass;
+    renderPassInfo.framebuffer = f->framebuffer;
+    renderPassInfo.renderArea = e->rect;
     VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
     renderPassInfo.clearValueCount = 1;
     renderPassInfo.pClearValues = &clearColor;
-    vkCmdBeginRenderPass(buffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-    VkBuffer vertexBuffers[] = {vertexBuffer};
-    VkDeviceSize offsets[] = {0};
-    vkCmdBindVertexBuffers(buffer, 0, 1, vertexBuffers, offsets);
-    vkCmdDraw(buffer, vertexCount, 1, 0, 0);
+    vkCmdBeginRenderPass(buffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    vkCmdExecuteCommands(buffer, 1, &scene);
     vkCmdEndRenderPass(buffer);
+}
 
-    if (vkEndCommandBuffer(buffer) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
-    }
-    printf("done.\n");
+void recordRenderCommands(Elham *e, Frame *f, VkCommandBuffer buffer, VkCommandBuffer scene) {
+    VkCommandBufferBeginInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    info.flags = 0;
+    info.pInheritanceInfo = NULL;
+    VK_CHECK_RESULT(vkBeginCommandBuffer(buffer, &info))
+
+    beginTimestamp(e, f, buffer, STAGE_RENDER, 0);
+    recordRenderPass(e, f, buffer, scene);
+    endTimestamp(e, f, buffer, STAGE_RENDER, 0);
+
+    VK_CHECK_RESULT(vkEndCommandBuffer(buffer))
 }
 
-void createDstImage(Elham *e) {
-    VkImageUsageFlagBits usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+void createDstImage(Elham *e, Frame *f) {
+    bool cpu = e->ycbcr.kernel == KERNEL_CPU;
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | (cpu ? 0 : VK_IMAGE_USAGE_STORAGE_BIT);
+    VkFormatFeatureFlags features = VK_FORMAT_FEATURE_TRANSFER_DST_BIT | (cpu ? 0 : VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT);
     VkPhysicalDevice gpu = e->gpu;
     VkDevice device = e->device;
     VkFormat format = e->format;
 
     VkImage image;
-    VkDeviceMemory memory;
 
     printf("Create destination image...");
     VkFormatProperties formatProperties;
     vkGetPhysicalDeviceFormatProperties(gpu, format, &formatProperties);
-    if (!(formatProperties.linearTilingFeatures & usage)) {
+    if ((formatProperties.linearTilingFeatures & features) != features) {
         printf("Linear tiling can't be copied into + passed to compute shader.\n");
         exit(EXIT_FAILURE);
     }
@@ -946,42 +2197,66 @@ void createDstImage(Elham *e) {
     }
     printf("done.\n");
 
-    VkMemoryRequirements req;
-    vkGetImageMemoryRequirements(device, image, &req);
-
-    VkMemoryAllocateInfo alloc = {0};
-    alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc.allocationSize = req.size;
-    alloc.memoryTypeIndex = findMemoryType(gpu, req.memoryTypeBits,
-                                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
     printf("Allocating memory for destination image...");
-    if (vkAllocateMemory(device, &alloc, NULL, &memory) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
-    }
-    if (vkBindImageMemory(device, image, memory, 0) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
-    }
+    allocateImage(e, image, info.tiling, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+                  &f->dstImageMemory);
     printf("done.\n");
 
-    e->dstImage = image;
-    e->dstImageMemory = memory;
+    f->dstImage = image;
+}
+
+// Bytes per Y'CbCr sample. Samples of more than 8 bits take 16, which is also how x265 wants them.
+uint32_t sampleSize(Elham const *e) {
+    return e->color.depth > 8 ? 2 : 1;
+}
+
+uint32_t planeCount(Elham const *e) {
+    return pixelFormats[e->color.format].interleaved ? 2 : 3;
+}
+
+// In samples, so an NV12 chroma plane is as wide as the luma plane.
+uint32_t planeWidth(Elham const *e, int plane) {
+    if (plane == 0 || pixelFormats[e->color.format].interleaved) {
+        return e->width;
+    }
+    return e->width >> pixelFormats[e->color.format].shiftX;
+}
+
+uint32_t planeHeight(Elham const *e, int plane) {
+    return plane == 0 ? e->height : e->height >> pixelFormats[e->color.format].shiftY;
+}
+
+// Rows of plane the device holds at once, a band of them when frames are converted in bands.
+uint32_t bandRows(Elham const *e, int plane) {
+    return planeHeight(e, plane) / e->bands;
+}
+
+VkDeviceSize planeSize(Elham const *e, int plane) {
+    return (VkDeviceSize) planeWidth(e, plane) * planeHeight(e, plane) * sampleSize(e);
 }
 
-void createYImage(Elham *e) {
+// All planes back to back, which is the same for NV12 and I420.
+VkDeviceSize frameSize(Elham const *e) {
+    VkDeviceSize size = 0;
+    for (uint32_t i = 0; i < planeCount(e); i++) {
+        size += planeSize(e, i);
+    }
+    return size;
+}
+
+void createYImage(Elham *e, Frame *f) {
     VkPhysicalDevice gpu = e->gpu;
     VkDevice device = e->device;
     VkFormat format = e->ycbcr.format;
 
     VkImage image;
-    VkDeviceMemory memory;
 
     printf("Create Y' image...");
     VkFormatProperties formatProperties;
     vkGetPhysicalDeviceFormatProperties(gpu, format, &formatProperties);
-    if (!(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+    VkFormatFeatureFlags features = e->deviceLocalPlanes ? formatProperties.optimalTilingFeatures
+                                                         : formatProperties.linearTilingFeatures;
+    if (!(features & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
         printf("Can not store image with this format.\n");
         exit(EXIT_FAILURE);
     }
@@ -997,48 +2272,39 @@ void createYImage(Elham *e) {
     info.mipLevels = 1;
     info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     info.samples = VK_SAMPLE_COUNT_1_BIT;
-    info.tiling = VK_IMAGE_TILING_LINEAR;
-    info.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+    info.tiling = e->deviceLocalPlanes ? VK_IMAGE_TILING_OPTIMAL : VK_IMAGE_TILING_LINEAR;
+    info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
     if (vkCreateImage(device, &info, NULL, &image) != VK_SUCCESS) {
         printf("failed.");
         exit(EXIT_FAILURE);
     }
     printf("done.\n");
 
-    VkMemoryRequirements req;
-    vkGetImageMemoryRequirements(device, image, &req);
-
-    VkMemoryAllocateInfo alloc = {0};
-    alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc.allocationSize = req.size;
-    alloc.memoryTypeIndex = findMemoryType(gpu, req.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
     printf("Allocating memory for Y' image...");
-    if (vkAllocateMemory(device, &alloc, NULL, &memory) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
-    }
-    if (vkBindImageMemory(device, image, memory, 0) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
+    if (e->deviceLocalPlanes) {
+        allocateImage(e, image, info.tiling, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &f->ycbcr.yMemory);
+    } else {
+        allocateImage(e, image, info.tiling, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+                      &f->ycbcr.yMemory);
     }
     printf("done.\n");
 
-    e->ycbcr.y = image;
-    e->ycbcr.yMemory = memory;
+    f->ycbcr.y = image;
 }
 
-void createCbImage(Elham *e) {
+void createCbImage(Elham *e, Frame *f) {
     VkPhysicalDevice gpu = e->gpu;
     VkDevice device = e->device;
     VkFormat format = e->ycbcr.format;
 
     VkImage image;
-    VkDeviceMemory memory;
 
-    printf("Create Cb image...");
+    printf("Create %s image...", pixelFormats[e->color.format].interleaved ? "CbCr" : "Cb");
     VkFormatProperties formatProperties;
     vkGetPhysicalDeviceFormatProperties(gpu, format, &formatProperties);
-    if (!(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+    VkFormatFeatureFlags features = e->deviceLocalPlanes ? formatProperties.optimalTilingFeatures
+                                                         : formatProperties.linearTilingFeatures;
+    if (!(features & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
         printf("Can not store image with this format.\n");
         exit(EXIT_FAILURE);
     }
@@ -1047,55 +2313,46 @@ void createCbImage(Elham *e) {
     info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     info.imageType = VK_IMAGE_TYPE_2D;
     info.format = format;
-    info.extent.width = (e->rect.extent.width) / 2;
-    info.extent.height = (e->rect.extent.height) / 2;
+    info.extent.width = planeWidth(e, 1);
+    info.extent.height = bandRows(e, 1);
     info.extent.depth = 1;
     info.arrayLayers = 1;
     info.mipLevels = 1;
     info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     info.samples = VK_SAMPLE_COUNT_1_BIT;
-    info.tiling = VK_IMAGE_TILING_LINEAR;
-    info.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+    info.tiling = e->deviceLocalPlanes ? VK_IMAGE_TILING_OPTIMAL : VK_IMAGE_TILING_LINEAR;
+    info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
     if (vkCreateImage(device, &info, NULL, &image) != VK_SUCCESS) {
         printf("failed.");
         exit(EXIT_FAILURE);
     }
     printf("done.\n");
 
-    VkMemoryRequirements req;
-    vkGetImageMemoryRequirements(device, image, &req);
-
-    VkMemoryAllocateInfo alloc = {0};
-    alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc.allocationSize = req.size;
-    alloc.memoryTypeIndex = findMemoryType(gpu, req.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
     printf("Allocating memory for Cb image...");
-    if (vkAllocateMemory(device, &alloc, NULL, &memory) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
-    }
-    if (vkBindImageMemory(device, image, memory, 0) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
+    if (e->deviceLocalPlanes) {
+        allocateImage(e, image, info.tiling, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &f->ycbcr.cbMemory);
+    } else {
+        allocateImage(e, image, info.tiling, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+                      &f->ycbcr.cbMemory);
     }
     printf("done.\n");
 
-    e->ycbcr.cb = image;
-    e->ycbcr.cbMemory = memory;
+    f->ycbcr.cb = image;
 }
 
-void createCrImage(Elham *e) {
+void createCrImage(Elham *e, Frame *f) {
     VkPhysicalDevice gpu = e->gpu;
     VkDevice device = e->device;
     VkFormat format = e->ycbcr.format;
 
     VkImage image;
-    VkDeviceMemory memory;
 
     printf("Create Cr image...");
     VkFormatProperties formatProperties;
     vkGetPhysicalDeviceFormatProperties(gpu, format, &formatProperties);
-    if (!(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+    VkFormatFeatureFlags features = e->deviceLocalPlanes ? formatProperties.optimalTilingFeatures
+                                                         : formatProperties.linearTilingFeatures;
+    if (!(features & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
         printf("Can not store image with this format.\n");
         exit(EXIT_FAILURE);
     }
@@ -1104,41 +2361,57 @@ void createCrImage(Elham *e) {
     info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     info.imageType = VK_IMAGE_TYPE_2D;
     info.format = format;
-    info.extent.width = (e->rect.extent.width) / 2;
-    info.extent.height = (e->rect.extent.height) / 2;
+    info.extent.width = planeWidth(e, 2);
+    info.extent.height = bandRows(e, 2);
     info.extent.depth = 1;
     info.arrayLayers = 1;
     info.mipLevels = 1;
     info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     info.samples = VK_SAMPLE_COUNT_1_BIT;
-    info.tiling = VK_IMAGE_TILING_LINEAR;
-    info.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+    info.tiling = e->deviceLocalPlanes ? VK_IMAGE_TILING_OPTIMAL : VK_IMAGE_TILING_LINEAR;
+    info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
     if (vkCreateImage(device, &info, NULL, &image) != VK_SUCCESS) {
         printf("failed.");
         exit(EXIT_FAILURE);
     }
     printf("done.\n");
 
-    VkMemoryRequirements req;
-    vkGetImageMemoryRequirements(device, image, &req);
-
-    VkMemoryAllocateInfo alloc = {0};
-    alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc.allocationSize = req.size;
-    alloc.memoryTypeIndex = findMemoryType(gpu, req.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
     printf("Allocating memory for Cr image...");
-    if (vkAllocateMemory(device, &alloc, NULL, &memory) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
+    if (e->deviceLocalPlanes) {
+        allocateImage(e, image, info.tiling, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &f->ycbcr.crMemory);
+    } else {
+        allocateImage(e, image, info.tiling, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+                      &f->ycbcr.crMemory);
     }
-    if (vkBindImageMemory(device, image, memory, 0) != VK_SUCCESS) {
+    printf("done.\n");
+
+    f->ycbcr.cr = image;
+}
+
+/*
+ * A whole frame even when it is converted in bands: the encoder is lent the frame's planes from here, and x265 only
+ * takes whole pictures, so bands bound device memory but not this.
+ */
+void createReadbackBuffer(Elham *e, Frame *f) {
+    VkPhysicalDevice gpu = e->gpu;
+    VkDevice device = e->device;
+
+    printf("Create Y'CbCr readback buffer...");
+    VkBufferCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = frameSize(e);
+    // the packed kernel writes it directly, otherwise the planes are copied into it
+    info.usage = e->ycbcr.kernel == KERNEL_PACKED ? VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                                                  : VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (vkCreateBuffer(device, &info, NULL, &f->ycbcr.readback) != VK_SUCCESS) {
         printf("failed.\n");
         exit(EXIT_FAILURE);
     }
-    printf("done.\n");
 
-    e->ycbcr.cr = image;
-    e->ycbcr.crMemory = memory;
+    allocateBuffer(e, f->ycbcr.readback, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+                   &f->ycbcr.readbackMemory);
+    printf("done.\n");
 }
 
 
@@ -1161,92 +2434,516 @@ void block(VkDevice device, VkFence const *fence) {
     vkResetFences(device, 1, fence);
 }
 
-void process(Elham *e) {
-    const char *data;
+/*
+ * Fills the uniform the Y'CbCr kernels convert with: the matrix for e->color, the scale and offset that quantise to its
+ * range and depth, and the BT.709 transfer function, which 601 and 2020 share. The input is rgba8, so the transfer
+ * function only ever sees 256 values; they are computed here once instead of a pow() per channel and pixel. The CPU
+ * converter builds its tables from the same values.
+ */
+void fillConversion(Elham const *e, Conversion *c) {
+    ColorFormat const *color = &e->color;
+    memset(c, 0, sizeof(Conversion));
+
+    double kr = colorMatrices[color->matrix].kr;
+    double kb = colorMatrices[color->matrix].kb;
+    double kg = 1.0 - kr - kb;
+    double rows[3][3] = {
+        {kr, kg, kb},
+        {-kr / (2 * (1 - kb)), -kg / (2 * (1 - kb)), 0.5},
+        {0.5, -kg / (2 * (1 - kr)), -kb / (2 * (1 - kr))}
+    };
+    for (int column = 0; column < 3; column++) {
+        for (int row = 0; row < 3; row++) {
+            c->matrix[column][row] = (float) rows[row][column];
+        }
+    }
 
-    if (vkMapMemory(e->device, e->dstImageMemory, 0, VK_WHOLE_SIZE, 0, (void **) &data) != VK_SUCCESS) {
-        printf("Failed to map memory for destination image.");
-        exit(EXIT_FAILURE);
+    // H.273: limited range puts black at 16 and the chroma extremes at 16 and 240, scaled up for deeper samples
+    float peak = (float) ((1u << color->depth) - 1);
+    float step = (float) (1u << (color->depth - 8));
+    if (color->fullRange) {
+        c->scale[0] = c->scale[1] = peak;
+        c->offset[0] = 0;
+        c->offset[1] = (float) (1u << (color->depth - 1));
+    } else {
+        c->scale[0] = 219 * step;
+        c->scale[1] = 224 * step;
+        c->offset[0] = 16 * step;
+        c->offset[1] = 128 * step;
     }
+    c->peak = peak;
+    c->unorm = e->ycbcr.format == VK_FORMAT_R16_UNORM ? 65535.0f : 255.0f;
+    c->siting = color->siting == CHROMA_LEFT ? 1.0f : 0.5f;
 
-    VkImageSubresource subResource = {0};
-    subResource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    VkSubresourceLayout layout;
-    vkGetImageSubresourceLayout(e->device, e->dstImage, &subResource, &layout);
+    for (int i = 0; i < 256; i++) {
+        double s = i / 255.0;
+        c->transfer[i] = (float) (s < 0.018 ? 4.5 * s : 1.099 * pow(s, 1.0 / 2.2) - 0.099);
+    }
+}
 
-    e->callback(data + layout.offset, layout.rowPitch);
-    vkUnmapMemory(e->device, e->dstImageMemory);
+// A sample of row row of the matrix: R, G and B terms added in the order of ycbcr.comp.
+static inline float cpuTerm(CpuTables const *t, int row, uint8_t const *pixel) {
+    return (t->terms[row][0][pixel[0]] + t->terms[row][1][pixel[1]]) + t->terms[row][2][pixel[2]];
 }
 
-void saveRaw(const char *data, VkDeviceSize rowPitch) {
-    static unsigned long frameNumber = 0;
-    char filename[] = "output/0000";
-    sprintf(filename, "output/%04lu", frameNumber);
-    FILE *f = fopen(filename, "w");
-    for (int32_t y = 0; y < height; y++) {
-        unsigned int *row = (unsigned int *) data;
-        fwrite(row, 4, width, f);
-        data += rowPitch;
-    }
-    fclose(f);
+static inline uint8_t cpuQuantize(CpuTables const *t, float v, int c) {
+    float q = floorf(t->scale[c] * v + t->offset[c] + 0.5f);
+    return (uint8_t) (q < 0 ? 0 : q > t->peak ? t->peak : q);
+}
 
-    frameNumber++;
+// mix(right, left, siting) of ycbcr.comp
+static inline float cpuSited(CpuTables const *t, float left, float right) {
+    return right * t->notSiting + left * t->siting;
 }
 
-void saveYCbCr(
-    void *dataY, VkDeviceSize rowPitchY,
-    void *dataCb, VkDeviceSize rowPitchCb,
-    void *dataCr, VkDeviceSize rowPitchCr
-    ) {
-    static unsigned long frameNumber = 0;
-    char filename[] = "output/0000.yuv";
-    sprintf(filename, "output/%04lu.yuv", frameNumber);
-    FILE *f = fopen(filename, "w");
-    for (int32_t y = 0; y < height; y++) {
-        uint8_t *row = (uint8_t *) dataY;
-        fwrite(row, 1, width, f);
-        dataY += rowPitchY;
-    }
-    for (int32_t y = 0; y < (height / 2); y++) {
-        uint8_t *row = (uint8_t *) dataCb;
-        fwrite(row, 1, (width / 2), f);
-        dataCb += rowPitchCb;
+// Four Y' and one Cb and Cr of the 2x2 block whose top left pixel is top[0..3].
+static inline void cpuBlock(CpuTables const *t, uint8_t const *top, uint8_t const *bottom, uint8_t *yTop,
+                            uint8_t *yBottom, uint8_t *cb, uint8_t *cr) {
+    uint8_t const *pixels[4] = {top, top + 4, bottom, bottom + 4};
+    float chroma[4][2];
+    uint8_t luma[4];
+    for (int i = 0; i < 4; i++) {
+        luma[i] = cpuQuantize(t, cpuTerm(t, 0, pixels[i]), 0);
+        chroma[i][0] = cpuTerm(t, 1, pixels[i]);
+        chroma[i][1] = cpuTerm(t, 2, pixels[i]);
     }
-    for (int32_t y = 0; y < (height / 2); y++) {
-        uint8_t *row = (uint8_t *) dataCr;
-        fwrite(row, 1, (width / 2), f);
-        dataCr += rowPitchCr;
-    }
-    fclose(f);
-
-    frameNumber++;
+    yTop[0] = luma[0];
+    yTop[1] = luma[1];
+    yBottom[0] = luma[2];
+    yBottom[1] = luma[3];
+    *cb = cpuQuantize(t, (cpuSited(t, chroma[0][0], chroma[1][0]) + cpuSited(t, chroma[2][0], chroma[3][0])) * 0.5f, 1);
+    *cr = cpuQuantize(t, (cpuSited(t, chroma[0][1], chroma[1][1]) + cpuSited(t, chroma[2][1], chroma[3][1])) * 0.5f, 1);
 }
 
-void saveYCbCr2(
-    const char *dataY, VkDeviceSize rowPitchY,
-    const char *dataCb, VkDeviceSize rowPitchCb,
-    const char *dataCr, VkDeviceSize rowPitchCr
-    ) {
-    static unsigned long frameNumber = 0;
-    char filename[] = "output/0000.y";
-    sprintf(filename, "output/%04lu.y", frameNumber);
-    FILE *f = fopen(filename, "w");
-    for (int32_t y = 0; y < height; y++) {
-        uint8_t *row = (uint8_t *) dataY;
-        fwrite(row, 1, width, f);
-        dataY += rowPitchY;
+// Where row pair pair of a job is read from and written to.
+typedef struct {
+    uint8_t const *top;
+    uint8_t const *bottom;
+    uint8_t *yTop;
+    uint8_t *yBottom;
+    // the chroma of the block at column x is at cb[x / 2 * step] and cr[x / 2 * step]
+    uint8_t *cb;
+    uint8_t *cr;
+    uint32_t step;
+} CpuRows;
+
+static inline CpuRows cpuRows(CpuJob const *job, uint32_t pair) {
+    CpuRows r;
+    r.top = job->rgba + (size_t) 2 * pair * job->pitch;
+    r.bottom = r.top + job->pitch;
+    r.yTop = job->y + (size_t) 2 * pair * job->width;
+    r.yBottom = r.yTop + job->width;
+    if (job->interleaved) {
+        r.cb = job->cb + (size_t) pair * job->width;
+        r.cr = r.cb + 1;
+        r.step = 2;
+    } else {
+        r.cb = job->cb + (size_t) pair * (job->width / 2);
+        r.cr = job->cr + (size_t) pair * (job->width / 2);
+        r.step = 1;
     }
-    fclose(f);
+    return r;
+}
 
-    char filename2[] = "output/0000.cb";
-    sprintf(filename2, "output/%04lu.cb", frameNumber);
-    FILE *f2 = fopen(filename2, "w");
-    for (int32_t y = 0; y < (height / 2); y++) {
-        uint8_t *row = (uint8_t *) dataCb;
-        fwrite(row, 1, (width / 2), f2);
-        dataCb += rowPitchCb;
+// Blocks from column x to the end of the rows.
+static inline void cpuBlocks(CpuTables const *t, CpuRows const *r, uint32_t x, uint32_t width) {
+    for (; x < width; x += 2) {
+        cpuBlock(t, r->top + 4 * x, r->bottom + 4 * x, r->yTop + x, r->yBottom + x, r->cb + x / 2 * r->step,
+                 r->cr + x / 2 * r->step);
     }
-    fclose(f2);
+}
+
+// The reference the vector versions are checked against, and what runs where there are none.
+void cpuRowsScalar(CpuTables const *t, CpuJob const *job, uint32_t first, uint32_t last) {
+    for (uint32_t pair = first; pair < last; pair++) {
+        CpuRows r = cpuRows(job, pair);
+        cpuBlocks(t, &r, 0, job->width);
+    }
+}
+
+#ifdef ELHAM_X86
+
+/*
+ * The vector versions do the scalar arithmetic lane by lane, in the same order and without fused multiply-adds, so
+ * their output is identical to cpuRowsScalar().
+ */
+
+__attribute__((target("sse4.1")))
+static inline __m128 cpuTerm4(CpuTables const *t, int row, uint8_t const *p) {
+    float const *r = t->terms[row][0];
+    float const *g = t->terms[row][1];
+    float const *b = t->terms[row][2];
+    __m128 vr = _mm_setr_ps(r[p[0]], r[p[4]], r[p[8]], r[p[12]]);
+    __m128 vg = _mm_setr_ps(g[p[1]], g[p[5]], g[p[9]], g[p[13]]);
+    __m128 vb = _mm_setr_ps(b[p[2]], b[p[6]], b[p[10]], b[p[14]]);
+    return _mm_add_ps(_mm_add_ps(vr, vg), vb);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i cpuQuantize4(CpuTables const *t, __m128 v, int c) {
+    __m128 q = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t->scale[c]), v), _mm_set1_ps(t->offset[c])),
+                          _mm_set1_ps(0.5f));
+    q = _mm_min_ps(_mm_max_ps(_mm_floor_ps(q), _mm_setzero_ps()), _mm_set1_ps(t->peak));
+    return _mm_cvttps_epi32(q);
+}
+
+// Chroma of the two blocks in four pixels of each row, in lanes 0 and 1.
+__attribute__((target("sse4.1")))
+static inline __m128 cpuChroma4(CpuTables const *t, int row, uint8_t const *top, uint8_t const *bottom) {
+    __m128 s = _mm_set1_ps(t->siting);
+    __m128 n = _mm_set1_ps(t->notSiting);
+    __m128 a = cpuTerm4(t, row, top);
+    __m128 b = cpuTerm4(t, row, bottom);
+    __m128 sitedTop = _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 3, 1)), n),
+                                 _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 0, 2, 0)), s));
+    __m128 sitedBottom = _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 3, 1)), n),
+                                    _mm_mul_ps(_mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 0, 2, 0)), s));
+    return _mm_mul_ps(_mm_add_ps(sitedTop, sitedBottom), _mm_set1_ps(0.5f));
+}
+
+__attribute__((target("sse4.1")))
+void cpuRowsSSE4(CpuTables const *t, CpuJob const *job, uint32_t first, uint32_t last) {
+    uint32_t vectorWidth = job->width & ~3u;
+    for (uint32_t pair = first; pair < last; pair++) {
+        CpuRows r = cpuRows(job, pair);
+        for (uint32_t x = 0; x < vectorWidth; x += 4) {
+            uint8_t const *top = r.top + 4 * x;
+            uint8_t const *bottom = r.bottom + 4 * x;
+            __m128i yTop = cpuQuantize4(t, cpuTerm4(t, 0, top), 0);
+            __m128i yBottom = cpuQuantize4(t, cpuTerm4(t, 0, bottom), 0);
+            __m128i luma = _mm_packus_epi16(_mm_packus_epi32(yTop, yBottom), _mm_setzero_si128());
+            uint32_t words[2] = {(uint32_t) _mm_cvtsi128_si32(luma), (uint32_t) _mm_extract_epi32(luma, 1)};
+            memcpy(r.yTop + x, words, 4);
+            memcpy(r.yBottom + x, words + 1, 4);
+
+            __m128i cb = cpuQuantize4(t, cpuChroma4(t, 1, top, bottom), 1);
+            __m128i cr = cpuQuantize4(t, cpuChroma4(t, 2, top, bottom), 1);
+            if (job->interleaved) {
+                __m128i cbcr = _mm_unpacklo_epi32(cb, cr);
+                uint32_t word = (uint32_t) _mm_cvtsi128_si32(
+                    _mm_packus_epi16(_mm_packus_epi32(cbcr, cbcr), _mm_setzero_si128()));
+                memcpy(r.cb + x, &word, 4);
+            } else {
+                __m128i bytes = _mm_packus_epi16(_mm_packus_epi32(cb, cr), _mm_setzero_si128());
+                uint16_t cbWord = (uint16_t) _mm_extract_epi16(bytes, 0);
+                uint16_t crWord = (uint16_t) _mm_extract_epi16(bytes, 2);
+                memcpy(r.cb + x / 2, &cbWord, 2);
+                memcpy(r.cr + x / 2, &crWord, 2);
+            }
+        }
+        cpuBlocks(t, &r, vectorWidth, job->width);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256 cpuTerm8(CpuTables const *t, int row, uint8_t const *p) {
+    __m256i pixels = _mm256_loadu_si256((__m256i const *) p);
+    __m256i mask = _mm256_set1_epi32(0xff);
+    __m256 vr = _mm256_i32gather_ps(t->terms[row][0], _mm256_and_si256(pixels, mask), 4);
+    __m256 vg = _mm256_i32gather_ps(t->terms[row][1], _mm256_and_si256(_mm256_srli_epi32(pixels, 8), mask), 4);
+    __m256 vb = _mm256_i32gather_ps(t->terms[row][2], _mm256_and_si256(_mm256_srli_epi32(pixels, 16), mask), 4);
+    return _mm256_add_ps(_mm256_add_ps(vr, vg), vb);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i cpuQuantize8(CpuTables const *t, __m256 v, int c) {
+    __m256 q = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(t->scale[c]), v),
+                                           _mm256_set1_ps(t->offset[c])), _mm256_set1_ps(0.5f));
+    q = _mm256_min_ps(_mm256_max_ps(_mm256_floor_ps(q), _mm256_setzero_ps()), _mm256_set1_ps(t->peak));
+    return _mm256_cvttps_epi32(q);
+}
+
+// Chroma of the four blocks in eight pixels of each row, in order in the low four lanes.
+__attribute__((target("avx2")))
+static inline __m128i cpuChroma8(CpuTables const *t, int row, uint8_t const *top, uint8_t const *bottom) {
+    __m256 s = _mm256_set1_ps(t->siting);
+    __m256 n = _mm256_set1_ps(t->notSiting);
+    __m256 a = cpuTerm8(t, row, top);
+    __m256 b = cpuTerm8(t, row, bottom);
+    // within each 128-bit lane, like cpuChroma4()
+    __m256 sitedTop = _mm256_add_ps(_mm256_mul_ps(_mm256_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 3, 1)), n),
+                                    _mm256_mul_ps(_mm256_shuffle_ps(a, a, _MM_SHUFFLE(2, 0, 2, 0)), s));
+    __m256 sitedBottom = _mm256_add_ps(_mm256_mul_ps(_mm256_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 3, 1)), n),
+                                       _mm256_mul_ps(_mm256_shuffle_ps(b, b, _MM_SHUFFLE(2, 0, 2, 0)), s));
+    __m256i q = cpuQuantize8(t, _mm256_mul_ps(_mm256_add_ps(sitedTop, sitedBottom), _mm256_set1_ps(0.5f)), 1);
+    return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(q, _mm256_setr_epi32(0, 1, 4, 5, 0, 1, 4, 5)));
+}
+
+__attribute__((target("avx2")))
+static inline __m128i cpuBytes8(__m256i v) {
+    __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_packus_epi16(words, words);
+}
+
+__attribute__((target("avx2")))
+void cpuRowsAVX2(CpuTables const *t, CpuJob const *job, uint32_t first, uint32_t last) {
+    uint32_t vectorWidth = job->width & ~7u;
+    for (uint32_t pair = first; pair < last; pair++) {
+        CpuRows r = cpuRows(job, pair);
+        for (uint32_t x = 0; x < vectorWidth; x += 8) {
+            uint8_t const *top = r.top + 4 * x;
+            uint8_t const *bottom = r.bottom + 4 * x;
+            _mm_storel_epi64((__m128i *) (r.yTop + x), cpuBytes8(cpuQuantize8(t, cpuTerm8(t, 0, top), 0)));
+            _mm_storel_epi64((__m128i *) (r.yBottom + x), cpuBytes8(cpuQuantize8(t, cpuTerm8(t, 0, bottom), 0)));
+
+            __m128i cb = cpuChroma8(t, 1, top, bottom);
+            __m128i cr = cpuChroma8(t, 2, top, bottom);
+            if (job->interleaved) {
+                __m128i words = _mm_packus_epi32(_mm_unpacklo_epi32(cb, cr), _mm_unpackhi_epi32(cb, cr));
+                _mm_storel_epi64((__m128i *) (r.cb + x), _mm_packus_epi16(words, words));
+            } else {
+                __m128i bytes = _mm_packus_epi16(_mm_packus_epi32(cb, cr), _mm_setzero_si128());
+                uint32_t cbWord = (uint32_t) _mm_cvtsi128_si32(bytes);
+                uint32_t crWord = (uint32_t) _mm_extract_epi32(bytes, 1);
+                memcpy(r.cb + x / 2, &cbWord, 4);
+                memcpy(r.cr + x / 2, &crWord, 4);
+            }
+        }
+        cpuBlocks(t, &r, vectorWidth, job->width);
+    }
+}
+
+#endif
+
+void cpuBand(CpuConverter *c, CpuJob const *job, uint32_t band) {
+    uint32_t pairs = job->height / 2;
+    c->rows(&c->tables, job, pairs * band / c->threadCount, pairs * (band + 1) / c->threadCount);
+}
+
+void *cpuWorkerThread(void *arg) {
+    CpuWorker *worker = arg;
+    CpuConverter *c = worker->converter;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (c->generation == seen && !c->quit) {
+            pthread_cond_wait(&c->start, &c->lock);
+        }
+        if (c->quit) {
+            break;
+        }
+        seen = c->generation;
+        CpuJob job = c->job;
+        pthread_mutex_unlock(&c->lock);
+
+        cpuBand(c, &job, worker->index);
+
+        pthread_mutex_lock(&c->lock);
+        if (--c->remaining == 0) {
+            pthread_cond_signal(&c->done);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+void cpuFillTables(Elham const *e, CpuTables *t) {
+    Conversion conversion;
+    fillConversion(e, &conversion);
+    for (int row = 0; row < 3; row++) {
+        for (int channel = 0; channel < 3; channel++) {
+            for (int i = 0; i < 256; i++) {
+                t->terms[row][channel][i] = conversion.matrix[channel][row] * conversion.transfer[i];
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        t->scale[i] = conversion.scale[i];
+        t->offset[i] = conversion.offset[i];
+    }
+    t->peak = conversion.peak;
+    t->siting = conversion.siting;
+    t->notSiting = 1.0f - conversion.siting;
+}
+
+void cpuCreateConverter(Elham *e) {
+    CpuConverter *c = &e->ycbcr.cpu;
+    cpuFillTables(e, &c->tables);
+
+    c->rows = cpuRowsScalar;
+    c->isa = "scalar";
+#ifdef ELHAM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        c->rows = cpuRowsAVX2;
+        c->isa = "AVX2";
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        c->rows = cpuRowsSSE4;
+        c->isa = "SSE4.1";
+    }
+#endif
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    c->threadCount = CPU_THREADS > 0 ? CPU_THREADS : online > 0 ? (uint32_t) online : 1;
+    if (c->threadCount > e->height / 2) {
+        c->threadCount = e->height / 2;
+    }
+    if (c->threadCount == 0) {
+        c->threadCount = 1;
+    }
+    printf("Create %s CPU Y'CbCr converter, %u thread(s)...", c->isa, c->threadCount);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->start, NULL);
+    pthread_cond_init(&c->done, NULL);
+    c->generation = 0;
+    c->remaining = 0;
+    c->quit = false;
+    c->workers = calloc(c->threadCount, sizeof(CpuWorker));
+    for (uint32_t i = 1; i < c->threadCount; i++) {
+        c->workers[i].converter = c;
+        c->workers[i].index = i;
+        if (pthread_create(&c->workers[i].thread, NULL, cpuWorkerThread, c->workers + i) != 0) {
+            printf("failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("done.\n");
+}
+
+void cpuDestroyConverter(Elham *e) {
+    CpuConverter *c = &e->ycbcr.cpu;
+    if (c->workers == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    c->quit = true;
+    pthread_cond_broadcast(&c->start);
+    pthread_mutex_unlock(&c->lock);
+    for (uint32_t i = 1; i < c->threadCount; i++) {
+        pthread_join(c->workers[i].thread, NULL);
+    }
+    free(c->workers);
+    c->workers = NULL;
+    pthread_cond_destroy(&c->done);
+    pthread_cond_destroy(&c->start);
+    pthread_mutex_destroy(&c->lock);
+}
+
+// Converts the linear RGBA copy of a frame into its host planes, on all of the converter's threads.
+void cpuConvert(Elham *e, Frame *f, char const *rgba, VkDeviceSize pitch) {
+    CpuConverter *c = &e->ycbcr.cpu;
+    CpuJob job = {0};
+    job.rgba = (uint8_t const *) rgba;
+    job.pitch = pitch;
+    job.width = e->width;
+    job.height = e->height;
+    job.y = f->ycbcr.host;
+    job.cb = job.y + planeSize(e, 0);
+    job.cr = job.cb + planeSize(e, 1);
+    job.interleaved = pixelFormats[e->color.format].interleaved;
+
+    double start = now();
+    pthread_mutex_lock(&c->lock);
+    c->job = job;
+    c->remaining = c->threadCount - 1;
+    c->generation++;
+    pthread_cond_broadcast(&c->start);
+    pthread_mutex_unlock(&c->lock);
+
+    cpuBand(c, &job, 0);
+
+    pthread_mutex_lock(&c->lock);
+    while (c->remaining > 0) {
+        pthread_cond_wait(&c->done, &c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (e->stats != NULL) {
+        record(e->stats + STAGE_YCBCR, (now() - start) * 1e3);
+    }
+}
+
+void process(Elham *e, Frame *f) {
+    if (e->directInput || (e->callback == NULL && e->ycbcr.kernel != KERNEL_CPU)) {
+        return;
+    }
+
+    Allocation const *a = &f->dstImageMemory;
+    invalidateAllocation(e, a);
+    if (e->callback != NULL) {
+        e->callback(a->data + a->layout.offset, a->layout.rowPitch, e->width, e->height);
+    }
+    if (e->ycbcr.kernel == KERNEL_CPU) {
+        cpuConvert(e, f, a->data + a->layout.offset, a->layout.rowPitch);
+    }
+}
+
+// Dumps the RGBA pixels of every frame to output/NNNN, see --dump-raw.
+void saveRaw(const char *data, VkDeviceSize rowPitch, uint32_t width, uint32_t height) {
+    // frames of every stream are numbered together, they may be rendered on several threads
+    static atomic_ulong frameCounter = 0;
+    unsigned long frameNumber = atomic_fetch_add(&frameCounter, 1);
+    char filename[32];
+    snprintf(filename, sizeof(filename), "output/%04lu", frameNumber);
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        printf("Failed to open %s: %s.\n", filename, strerror(errno));
+        return;
+    }
+    for (int32_t y = 0; y < height; y++) {
+        unsigned int *row = (unsigned int *) data;
+        fwrite(row, 4, width, f);
+        data += rowPitch;
+    }
+    fclose(f);
+}
+
+void saveYCbCr(
+    void *dataY, VkDeviceSize rowPitchY,
+    void *dataCb, VkDeviceSize rowPitchCb,
+    void *dataCr, VkDeviceSize rowPitchCr,
+    uint32_t width, uint32_t height
+    ) {
+    static unsigned long frameNumber = 0;
+    char filename[] = "output/0000.yuv";
+    sprintf(filename, "output/%04lu.yuv", frameNumber);
+    FILE *f = fopen(filename, "w");
+    for (int32_t y = 0; y < height; y++) {
+        uint8_t *row = (uint8_t *) dataY;
+        fwrite(row, 1, width, f);
+        dataY += rowPitchY;
+    }
+    for (int32_t y = 0; y < (height / 2); y++) {
+        uint8_t *row = (uint8_t *) dataCb;
+        fwrite(row, 1, (width / 2), f);
+        dataCb += rowPitchCb;
+    }
+    for (int32_t y = 0; y < (height / 2); y++) {
+        uint8_t *row = (uint8_t *) dataCr;
+        fwrite(row, 1, (width / 2), f);
+        dataCr += rowPitchCr;
+    }
+    fclose(f);
+
+    frameNumber++;
+}
+
+void saveYCbCr2(
+    const char *dataY, VkDeviceSize rowPitchY,
+    const char *dataCb, VkDeviceSize rowPitchCb,
+    const char *dataCr, VkDeviceSize rowPitchCr,
+    uint32_t width, uint32_t height
+    ) {
+    static unsigned long frameNumber = 0;
+    char filename[] = "output/0000.y";
+    sprintf(filename, "output/%04lu.y", frameNumber);
+    FILE *f = fopen(filename, "w");
+    for (int32_t y = 0; y < height; y++) {
+        uint8_t *row = (uint8_t *) dataY;
+        fwrite(row, 1, width, f);
+        dataY += rowPitchY;
+    }
+    fclose(f);
+
+    char filename2[] = "output/0000.cb";
+    sprintf(filename2, "output/%04lu.cb", frameNumber);
+    FILE *f2 = fopen(filename2, "w");
+    for (int32_t y = 0; y < (height / 2); y++) {
+        uint8_t *row = (uint8_t *) dataCb;
+        fwrite(row, 1, (width / 2), f2);
+        dataCb += rowPitchCb;
+    }
+    fclose(f2);
 
     char filename3[] = "output/0000.cr";
     sprintf(filename3, "output/%04lu.cr", frameNumber);
@@ -1272,17 +2969,53 @@ VkFence createFence(VkDevice device) {
     return fence;
 }
 
-bool finished = false;
+VkSemaphore createSemaphore(VkDevice device) {
+    VkSemaphore semaphore;
+    VkSemaphoreCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    if (vkCreateSemaphore(device, &info, NULL, &semaphore) != VK_SUCCESS) {
+        printf("Failed to create semaphore.");
+        exit(EXIT_FAILURE);
+    }
+    return semaphore;
+}
 
-void memoryMApY(const Elham *e, const char **yData, VkSubresourceLayout *layout);
+VkSemaphore createTimelineSemaphore(VkDevice device) {
+    VkSemaphore semaphore;
+    VkSemaphoreTypeCreateInfo type = {0};
+    type.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    type.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    type.initialValue = 0;
+    VkSemaphoreCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    info.pNext = &type;
+    if (vkCreateSemaphore(device, &info, NULL, &semaphore) != VK_SUCCESS) {
+        printf("Failed to create timeline semaphore.");
+        exit(EXIT_FAILURE);
+    }
+    return semaphore;
+}
 
-void memoryMapCb(const Elham *e, const char **cbData, VkSubresourceLayout *layoutCb);
+void blockTimeline(VkDevice device, VkSemaphore semaphore, uint64_t value) {
+    VkSemaphoreWaitInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    info.semaphoreCount = 1;
+    info.pSemaphores = &semaphore;
+    info.pValues = &value;
+    if (vkWaitSemaphores(device, &info, UINT64_MAX) != VK_SUCCESS) {
+        printf("Failed waiting for timeline semaphore.");
+        exit(EXIT_FAILURE);
+    }
+}
 
-void memoryMapCr(const Elham *e, const char **crData, VkSubresourceLayout *layoutCr);
+volatile sig_atomic_t finished = 0;
 
-void handleSigint() {
-    printf("SIGINT received, finishing ...\n");
-    finished = true;
+// Only asks the render loop to stop, which then drains the frames in flight and flushes the encoder.
+void handleSigint(int sig) {
+    static const char message[] = "Signal received, finishing ...\n";
+    (void) sig;
+    write(STDERR_FILENO, message, sizeof(message) - 1);
+    finished = 1;
 }
 
 void setDimensions(Elham *e, uint32_t width, uint32_t height) {
@@ -1291,58 +3024,243 @@ void setDimensions(Elham *e, uint32_t width, uint32_t height) {
     e->rect = (struct VkRect2D) {.offset={.x=0, .y=0}, .extent={.width=width, .height=height}};
 }
 
-void createVertexBuffer(Elham *e, size_t count) {
+/*
+ * Copies size bytes of data into buffer, which may be device-local, through a staging buffer, and waits for the copy.
+ * Only for data that is uploaded once: the GPU is idle afterwards and the buffer is ready to be read by draws.
+ */
+void uploadBuffer(Elham *e, VkBuffer buffer, void const *data, VkDeviceSize size) {
     VkDevice device = e->device;
-    VkPhysicalDevice gpu = e->gpu;
 
-    printf("Create vertex buffer...");
-    VkBuffer buff = VK_NULL_HANDLE;
+    VkBuffer staging;
+    Allocation stagingMemory;
     VkBufferCreateInfo info = {0};
     info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    info.size = sizeof(Vertex) * count;
-    info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    info.size = size;
+    info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
     info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK_RESULT(vkCreateBuffer(device, &info, NULL, &staging))
+    allocateBuffer(e, staging, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, 0, &stagingMemory);
+    memcpy(stagingMemory.data, data, size);
+    flushAllocation(e, &stagingMemory);
+
+    VkCommandPool pool;
+    VkCommandPoolCreateInfo poolInfo = {0};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = e->graphicsQueueFamilyIndex;
+    VK_CHECK_RESULT(vkCreateCommandPool(device, &poolInfo, NULL, &pool))
+
+    VkCommandBuffer buff;
+    VkCommandBufferAllocateInfo allocInfo = {0};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = pool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+    VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &allocInfo, &buff))
+
+    VkCommandBufferBeginInfo beginInfo = {0};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK_RESULT(vkBeginCommandBuffer(buff, &beginInfo))
+    VkBufferCopy region = {0};
+    region.size = size;
+    vkCmdCopyBuffer(buff, staging, buffer, 1, &region);
+    VkMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+                            VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,
+                         1, &barrier, 0, NULL, 0, NULL);
+    VK_CHECK_RESULT(vkEndCommandBuffer(buff))
+
+    VkSubmitInfo submitInfo = {0};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &buff;
+    VK_CHECK_RESULT(vkQueueSubmit(e->graphicQueue, 1, &submitInfo, VK_NULL_HANDLE))
+    VK_CHECK_RESULT(vkQueueWaitIdle(e->graphicQueue))
+
+    vkDestroyCommandPool(device, pool, NULL);
+    vkDestroyBuffer(device, staging, NULL);
+    freeAllocation(e, &stagingMemory);
+}
 
-    if (vkCreateBuffer(device, &info, NULL, &buff) != VK_SUCCESS) {
+// A device-local buffer holding size bytes of data.
+void createStaticBuffer(Elham *e, VkBufferUsageFlags usage, void const *data, VkDeviceSize size, VkBuffer *buffer,
+                        Allocation *a) {
+    VkBufferCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = size;
+    info.usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (vkCreateBuffer(e->device, &info, NULL, buffer) != VK_SUCCESS) {
         printf("failed to create buffer.\n");
         exit(EXIT_FAILURE);
     }
+    allocateBuffer(e, *buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, a);
+    uploadBuffer(e, *buffer, data, size);
+}
 
-    VkMemoryRequirements req;
-    vkGetBufferMemoryRequirements(device, buff, &req);
-    VkMemoryAllocateInfo aloc = {0};
-    aloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    aloc.allocationSize = req.size;
-    aloc.memoryTypeIndex = findMemoryType(gpu, req.memoryTypeBits,
-                                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    VkDeviceMemory mem;
-    if (vkAllocateMemory(device, &aloc, NULL, &mem) != VK_SUCCESS) {
-        printf("failed to allocate vertex buffer memory.\n");
-        exit(EXIT_FAILURE);
+/*
+ * Uploads count primitives, grouped by Shape so that each shape is one instanced draw, and the draws. Every stream on
+ * the device draws this scene.
+ */
+void createScene(Elham *e, Primitive const *primitives, uint32_t count) {
+    Scene *scene = &e->scene;
+
+    printf("Create scene of %u primitive(s)...", count);
+    uint32_t first[SHAPE_COUNT + 1] = {0};
+    for (uint32_t i = 0; i < count; i++) {
+        first[primitives[i].shape + 1]++;
+    }
+    for (Shape shape = 0; shape < SHAPE_COUNT; shape++) {
+        first[shape + 1] += first[shape];
+    }
+    Instance *instances = malloc(count * sizeof(Instance));
+    uint32_t next[SHAPE_COUNT];
+    memcpy(next, first, sizeof(next));
+    for (uint32_t i = 0; i < count; i++) {
+        instances[next[primitives[i].shape]++] = primitives[i].instance;
+    }
+
+    scene->drawCount = 0;
+    for (Shape shape = 0; shape < SHAPE_COUNT; shape++) {
+        if (first[shape + 1] == first[shape]) {
+            continue;
+        }
+        VkDrawIndexedIndirectCommand *c = scene->commands + scene->drawCount++;
+        c->indexCount = meshes[shape].indexCount;
+        c->instanceCount = first[shape + 1] - first[shape];
+        c->firstIndex = meshes[shape].firstIndex;
+        c->vertexOffset = meshes[shape].vertexOffset;
+        c->firstInstance = first[shape];
     }
-    vkBindBufferMemory(device, buff, mem, 0);
+    scene->instanceCount = count;
+
+    createStaticBuffer(e, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, meshVertices, sizeof(meshVertices), &scene->vertices,
+                       &scene->verticesMemory);
+    createStaticBuffer(e, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, meshIndices, sizeof(meshIndices), &scene->indices,
+                       &scene->indicesMemory);
+    createStaticBuffer(e, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, instances, count * sizeof(Instance), &scene->instances,
+                       &scene->instancesMemory);
+    createStaticBuffer(e, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, scene->commands,
+                       scene->drawCount * sizeof(VkDrawIndexedIndirectCommand), &scene->draws, &scene->drawsMemory);
+    free(instances);
     printf("done.\n");
+    printf("%u draw(s), %s.\n", scene->drawCount,
+           !scene->firstInstance ? "direct" : scene->multiDraw ? "one multi-draw indirect" : "indirect");
+}
+
+void destroyScene(Elham *e) {
+    Scene *scene = &e->scene;
+    VkBuffer buffers[4] = {scene->vertices, scene->indices, scene->instances, scene->draws};
+    Allocation *allocations[4] = {&scene->verticesMemory, &scene->indicesMemory, &scene->instancesMemory,
+                                  &scene->drawsMemory};
+    for (int i = 0; i < 4; i++) {
+        vkDestroyBuffer(e->device, buffers[i], NULL);
+        freeAllocation(e, allocations[i]);
+    }
+}
+
+/*
+ * The scene of the options: count shapes, triangles and quads in turn, on a grid filling the frame, like the many small
+ * shapes of an overlay, or the one full-frame triangle if count is 0. The caller frees it.
+ */
+Primitive *buildScene(uint32_t *count) {
+    if (*count == 0) {
+        *count = 1;
+        Primitive *triangle = calloc(1, sizeof(Primitive));
+        triangle->shape = SHAPE_TRIANGLE;
+        triangle->instance = (Instance) {.offset = {0, 0}, .scale = {1, 1}, .tint = {1, 1, 1}};
+        return triangle;
+    }
+
+    uint32_t side = (uint32_t) ceil(sqrt(*count));
+    float cell = 2.0f / side;
+    Primitive *primitives = malloc(*count * sizeof(Primitive));
+    for (uint32_t i = 0; i < *count; i++) {
+        Primitive *p = primitives + i;
+        p->shape = i % 2 ? SHAPE_QUAD : SHAPE_TRIANGLE;
+        p->instance.offset = (Vec2) {-1 + cell * (i % side + 0.5f), -1 + cell * (i / side + 0.5f)};
+        p->instance.scale = (Vec2) {0.4f * cell, 0.4f * cell};
+        p->instance.tint = (Vec3) {0.25f + 0.125f * (i % 7), 0.25f + 0.1875f * (i % 5), 0.25f + 0.375f * (i % 3)};
+    }
+    return primitives;
+}
+
+// One Transform set per frame in flight, every stream has its own pool.
+void createTransformPool(Elham *e) {
+    VkDescriptorPoolSize size = {0};
+    size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    size.descriptorCount = e->frameCount;
+    VkDescriptorPoolCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    info.maxSets = e->frameCount;
+    info.poolSizeCount = 1;
+    info.pPoolSizes = &size;
+    VK_CHECK_RESULT(vkCreateDescriptorPool(e->device, &info, NULL, &e->transformPool))
+}
+
+// Rotates the frame's vertices by angle about center. The frame must have retired, nothing else reads its Transform.
+void writeTransform(Elham *e, Frame *f, Vec2 center, float angle) {
+    float s = sinf(angle);
+    float c = cosf(angle);
+    Transform *t = (Transform *) f->transformMemory.data;
+    memset(t, 0, sizeof(Transform));
+    t->rotation[0][0] = c;
+    t->rotation[0][1] = s;
+    t->rotation[1][0] = -s;
+    t->rotation[1][1] = c;
+    t->center = center;
+    flushAllocation(e, &f->transformMemory);
+}
+
+void createTransform(Elham *e, Frame *f) {
+    VkDevice device = e->device;
+
+    VkBufferCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = sizeof(Transform);
+    info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK_RESULT(vkCreateBuffer(device, &info, NULL, &f->transform))
+    allocateBuffer(e, f->transform, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, 0, &f->transformMemory);
 
-    e->vertexCount = count;
-    e->vertexBufferMemory = mem;
-    e->vertexBuffer = buff;
+    VkDescriptorSetAllocateInfo allocInfo = {0};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = e->transformPool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &e->transformLayout;
+    VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &f->transformSet))
+
+    VkDescriptorBufferInfo bufferInfo = {0};
+    bufferInfo.buffer = f->transform;
+    bufferInfo.offset = 0;
+    bufferInfo.range = sizeof(Transform);
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = f->transformSet;
+    write.dstBinding = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    write.pBufferInfo = &bufferInfo;
+    vkUpdateDescriptorSets(device, 1, &write, 0, NULL);
+    writeTransform(e, f, (Vec2) {0, 0}, e->angle);
 }
 
-void recordCopyCommand(Elham *e) {
+void recordCopyCommand(Elham *e, Frame *f, VkCommandBuffer buffer) {
     VkCommandBufferBeginInfo info = {0};
     info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     info.flags = 0;
     info.pInheritanceInfo = NULL;
-    printf("Begin command buffer for Copy...");
-    if (vkBeginCommandBuffer(e->copyCommandBuffer, &info) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
-    }
-    printf("done.\n");
+    VK_CHECK_RESULT(vkBeginCommandBuffer(buffer, &info))
 
+    beginTimestamp(e, f, buffer, STAGE_COPY, 0);
     insertImageMemoryBarrier(
-        e->copyCommandBuffer,
-        e->dstImage,
+        buffer,
+        f->dstImage,
         0,
         VK_ACCESS_TRANSFER_WRITE_BIT,
         VK_IMAGE_LAYOUT_UNDEFINED,
@@ -1355,140 +3273,377 @@ void recordCopyCommand(Elham *e) {
     copy.srcSubresource.layerCount = 1;
     copy.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     copy.dstSubresource.layerCount = 1;
-    copy.extent.width = width;
-    copy.extent.height = height;
+    copy.extent.width = e->width;
+    copy.extent.height = e->height;
     copy.extent.depth = 1;
 
     vkCmdCopyImage(
-        e->copyCommandBuffer,
-        e->srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        e->dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        buffer,
+        f->srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        f->dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
         1,
         &copy);
 
+    // the CPU converter reads the copy on the host, make it visible there
+    bool host = e->ycbcr.kernel == KERNEL_CPU;
     insertImageMemoryBarrier(
-        e->copyCommandBuffer,
-        e->dstImage,
+        buffer,
+        f->dstImage,
         VK_ACCESS_TRANSFER_WRITE_BIT,
-        VK_ACCESS_MEMORY_READ_BIT,
+        host ? VK_ACCESS_HOST_READ_BIT : VK_ACCESS_MEMORY_READ_BIT,
         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
         VK_IMAGE_LAYOUT_GENERAL,
         VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VK_PIPELINE_STAGE_TRANSFER_BIT);
+        host ? VK_PIPELINE_STAGE_HOST_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT);
+    endTimestamp(e, f, buffer, STAGE_COPY, 0);
 
-    printf("End command buffer for Copy...");
-    if (vkEndCommandBuffer(e->copyCommandBuffer) != VK_SUCCESS) {
-        printf("failed.\n");
-        exit(EXIT_FAILURE);
-    }
-    printf("done.\n");
+    VK_CHECK_RESULT(vkEndCommandBuffer(buffer))
 }
 
-void fillVertexBuffer(Elham *e, Vertex vertices[]) {
-    void *data;
-    vkMapMemory(e->device, e->vertexBufferMemory, 0, sizeof(Vertex) * e->vertexCount, 0, &data);
-    memcpy(data, vertices, (size_t) sizeof(Vertex) * 3);
-    vkUnmapMemory(e->device, e->vertexBufferMemory);
-}
-
-void createFences(Elham *e) {
+void createFences(Elham *e, Frame *f) {
     printf("Create fences...");
     vkGetDeviceQueue(e->device, e->graphicsQueueFamilyIndex, 0, &e->graphicQueue);
-    e->renderFence = createFence(e->device);
-    e->copyFence = createFence(e->device);
+    f->renderFence = createFence(e->device);
+    f->copyFence = createFence(e->device);
+    f->ycbcr.fence = createFence(e->device);
+    f->rendered = createSemaphore(e->device);
+    f->copied = createSemaphore(e->device);
+    f->timeline = e->sync == SYNC_TIMELINE ? createTimelineSemaphore(e->device) : VK_NULL_HANDLE;
+    f->timelineValue = 0;
     printf("done.\n");
 }
 
-void frame(Elham *e) {
-    submit(e->renderCommandBuffer, e->graphicQueue, e->renderFence);
-    block(e->device, &e->renderFence);
-    submit(e->copyCommandBuffer, e->graphicQueue, e->copyFence);
-    block(e->device, &e->copyFence);
-    process(e);
+void frame(Elham *e, Frame *f) {
+    submit(f->renderCommandBuffer, e->graphicQueue, f->renderFence);
+    block(e->device, &f->renderFence);
+    if (e->directInput) {
+        return;
+    }
+    submit(f->copyCommandBuffer, e->graphicQueue, f->copyFence);
+    block(e->device, &f->copyFence);
+    process(e, f);
+}
+
+/*
+ * Timeline submission of one frame, see batchFrame(). The stages signal successive values of the frame's timeline
+ * semaphore and each waits on the value of the one before it.
+ */
+typedef struct {
+    VkCommandBuffer buffers[3];
+    VkPipelineStageFlags waitStages[3];
+    // stage i waits on values[i] and signals values[i + 1]
+    uint64_t values[4];
+    VkTimelineSemaphoreSubmitInfo timelineInfos[3];
+    VkSubmitInfo infos[3];
+    uint32_t count;
+    // whether the last submission is Y'CbCr, which may go to its own queue
+    bool compute;
+} TimelineSubmit;
+
+/*
+ * Frames of one or more streams on the same device, gathered by batchFrame() and sent by flushBatch() with one
+ * vkQueueSubmit per queue. The stages of each frame are ordered by its own timeline semaphore, so frames of
+ * different streams in one batch do not wait on each other.
+ */
+typedef struct {
+    TimelineSubmit *frames;
+    uint32_t count;
+    uint32_t capacity;
+    // every frame's render and copy, and its Y'CbCr when that shares the graphics queue
+    VkSubmitInfo *graphics;
+    // every frame's Y'CbCr otherwise
+    VkSubmitInfo *compute;
+} SubmitBatch;
+
+SubmitBatch createBatch(uint32_t capacity) {
+    SubmitBatch b = {0};
+    b.frames = calloc(capacity, sizeof(TimelineSubmit));
+    b.graphics = calloc(capacity * 3, sizeof(VkSubmitInfo));
+    b.compute = calloc(capacity, sizeof(VkSubmitInfo));
+    b.capacity = capacity;
+    return b;
+}
+
+void destroyBatch(SubmitBatch *b) {
+    free(b->frames);
+    free(b->graphics);
+    free(b->compute);
+    memset(b, 0, sizeof(*b));
+}
+
+// Adds render, copy and Y'CbCr of a frame to the batch, the host waits once, on the last value, in retireFrame().
+void batchFrame(SubmitBatch *b, Elham *e, Frame *f) {
+    assert(b->count < b->capacity);
+    TimelineSubmit *s = b->frames + b->count++;
+    uint32_t count = 0;
+    s->buffers[count] = f->renderCommandBuffer;
+    s->waitStages[count++] = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    if (!e->directInput) {
+        s->buffers[count] = f->copyCommandBuffer;
+        s->waitStages[count++] = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    // the CPU converter picks the frame up after the host wait instead, bands are converted as they are rendered
+    s->compute = e->ycbcr.kernel != KERNEL_CPU && e->bands == 1;
+    if (s->compute) {
+        s->buffers[count] = f->ycbcr.commandBuffer;
+        s->waitStages[count++] = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    }
+    s->count = count;
+
+    for (uint32_t i = 0; i <= count; i++) {
+        s->values[i] = f->timelineValue + i;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        memset(s->timelineInfos + i, 0, sizeof(VkTimelineSemaphoreSubmitInfo));
+        s->timelineInfos[i].sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        s->timelineInfos[i].waitSemaphoreValueCount = i > 0 ? 1 : 0;
+        s->timelineInfos[i].pWaitSemaphoreValues = s->values + i;
+        s->timelineInfos[i].signalSemaphoreValueCount = 1;
+        s->timelineInfos[i].pSignalSemaphoreValues = s->values + i + 1;
+
+        memset(s->infos + i, 0, sizeof(VkSubmitInfo));
+        s->infos[i].sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        s->infos[i].pNext = s->timelineInfos + i;
+        s->infos[i].waitSemaphoreCount = i > 0 ? 1 : 0;
+        s->infos[i].pWaitSemaphores = &f->timeline;
+        s->infos[i].pWaitDstStageMask = s->waitStages + i;
+        s->infos[i].commandBufferCount = 1;
+        s->infos[i].pCommandBuffers = s->buffers + i;
+        s->infos[i].signalSemaphoreCount = 1;
+        s->infos[i].pSignalSemaphores = &f->timeline;
+    }
+
+    f->timelineValue = s->values[count];
+    f->pending = true;
+}
+
+// Sends everything batched for the queues of e, whose device all batched frames are on, and empties the batch.
+void flushBatch(Elham const *e, SubmitBatch *b) {
+    bool shared = e->ycbcr.queue == e->graphicQueue;
+    uint32_t graphics = 0;
+    uint32_t compute = 0;
+    for (uint32_t i = 0; i < b->count; i++) {
+        TimelineSubmit const *s = b->frames + i;
+        uint32_t n = shared || !s->compute ? s->count : s->count - 1;
+        memcpy(b->graphics + graphics, s->infos, n * sizeof(VkSubmitInfo));
+        graphics += n;
+        if (n < s->count) {
+            b->compute[compute++] = s->infos[s->count - 1];
+        }
+    }
+
+    if (graphics > 0) {
+        VK_CHECK_RESULT(vkQueueSubmit(e->graphicQueue, graphics, b->graphics, VK_NULL_HANDLE))
+    }
+    if (compute > 0) {
+        VK_CHECK_RESULT(vkQueueSubmit(e->ycbcr.queue, compute, b->compute, VK_NULL_HANDLE))
+    }
+    b->count = 0;
+}
+
+/*
+ * Timeline flavour of submitFrame(), a batch of one: everything goes out in a single vkQueueSubmit when Y'CbCr shares
+ * the graphics queue.
+ */
+void submitFrameTimeline(Elham *e, Frame *f) {
+    TimelineSubmit frames[1];
+    VkSubmitInfo graphics[3];
+    VkSubmitInfo compute[1];
+    SubmitBatch b = {.frames = frames, .capacity = 1, .graphics = graphics, .compute = compute};
+    batchFrame(&b, e, f);
+    flushBatch(e, &b);
 }
 
+/*
+ * Queues render, copy and Y'CbCr of a frame without waiting on the host in between, the stages are ordered on the GPU
+ * by the frame's semaphores. Only the Y'CbCr fence is signaled, retireFrame() waits on it.
+ */
+void submitFrame(Elham *e, Frame *f) {
+    if (e->sync == SYNC_TIMELINE) {
+        submitFrameTimeline(e, f);
+        return;
+    }
+
+    VkPipelineStageFlags copyWaitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    VkPipelineStageFlags ycbcrWaitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+    // rendering bands also converts them, it is the only stage
+    bool bands = e->bands > 1;
+    VkSubmitInfo render = {0};
+    render.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    render.commandBufferCount = 1;
+    render.pCommandBuffers = &f->renderCommandBuffer;
+    render.signalSemaphoreCount = bands ? 0 : 1;
+    render.pSignalSemaphores = &f->rendered;
+    VK_CHECK_RESULT(vkQueueSubmit(e->graphicQueue, 1, &render, bands ? f->ycbcr.fence : VK_NULL_HANDLE))
+    if (bands) {
+        f->pending = true;
+        return;
+    }
+
+    VkSemaphore *converted = &f->rendered;
+    if (!e->directInput) {
+        // with the CPU converter the copy is the last GPU stage and signals the fence retireFrame() waits on
+        bool last = e->ycbcr.kernel == KERNEL_CPU;
+        VkSubmitInfo copy = {0};
+        copy.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        copy.waitSemaphoreCount = 1;
+        copy.pWaitSemaphores = &f->rendered;
+        copy.pWaitDstStageMask = &copyWaitStage;
+        copy.commandBufferCount = 1;
+        copy.pCommandBuffers = &f->copyCommandBuffer;
+        copy.signalSemaphoreCount = last ? 0 : 1;
+        copy.pSignalSemaphores = &f->copied;
+        VK_CHECK_RESULT(vkQueueSubmit(e->graphicQueue, 1, &copy, last ? f->ycbcr.fence : VK_NULL_HANDLE))
+        converted = &f->copied;
+        if (last) {
+            f->pending = true;
+            return;
+        }
+    }
 
-void postFrame() {
-    static unsigned int frames = 0;
+    VkSubmitInfo ycbcr = {0};
+    ycbcr.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    ycbcr.waitSemaphoreCount = 1;
+    ycbcr.pWaitSemaphores = converted;
+    ycbcr.pWaitDstStageMask = &ycbcrWaitStage;
+    ycbcr.commandBufferCount = 1;
+    ycbcr.pCommandBuffers = &f->ycbcr.commandBuffer;
+    VK_CHECK_RESULT(vkQueueSubmit(e->ycbcr.queue, 1, &ycbcr, f->ycbcr.fence))
 
-    frames++;
-    if(frames >= 1)  { finished = true; }
+    f->pending = true;
+}
 
+void retireFrame(Elham *e, Frame *f) {
+    double start = now();
+    if (e->sync == SYNC_TIMELINE) {
+        blockTimeline(e->device, f->timeline, f->timelineValue);
+    } else {
+        block(e->device, &f->ycbcr.fence);
+    }
+    if (e->stats != NULL) {
+        record(e->stats + STAGE_WAIT, (now() - start) * 1e3);
+    }
+    collectTimestamps(e, f);
+    process(e, f);
+    f->pending = false;
 }
 
 
-void ycbcr(Elham *e) {
+void ycbcr(Elham *e, Frame *f) {
+    if (e->ycbcr.kernel == KERNEL_CPU || e->bands > 1) {
+        // process() already converted the frame, or rendering it did
+        return;
+    }
     printf("Y'CbCr...");
 
     VkSubmitInfo submitInfo = {0};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &e->ycbcr.commandBuffer;
-    VK_CHECK_RESULT(vkQueueSubmit(e->ycbcr.queue, 1, &submitInfo, e->ycbcr.fence))
-    block(e->device, &e->ycbcr.fence);
+    submitInfo.pCommandBuffers = &f->ycbcr.commandBuffer;
+    VK_CHECK_RESULT(vkQueueSubmit(e->ycbcr.queue, 1, &submitInfo, f->ycbcr.fence))
+    block(e->device, &f->ycbcr.fence);
     printf("done.\n");
 }
 
-void memoryMapCr(const Elham *e, const char **crData, VkSubresourceLayout *layoutCr) {
-    if (vkMapMemory((*e).device, (*e).ycbcr.crMemory, 0, VK_WHOLE_SIZE, 0, (void **) crData) != VK_SUCCESS) {
-        printf("Failed to map memory for Cr image.");
-        exit(EXIT_FAILURE);
+void destroyCommands(Elham *e) {
+    for (Stage stage = 0; stage <= STAGE_YCBCR; stage++) {
+        CommandSet *set = e->commands + stage;
+        if (set->buffers == NULL) {
+            continue;
+        }
+        VkCommandPool pool = stage == STAGE_YCBCR ? e->ycbcr.commandPool : e->commandPool;
+        vkFreeCommandBuffers(e->device, pool, e->frameCount, set->buffers);
+        free(set->buffers);
+        if (set->secondaries != NULL) {
+            vkFreeCommandBuffers(e->device, pool, e->frameCount * e->bands, set->secondaries);
+            free(set->secondaries);
+        }
+        memset(set, 0, sizeof(*set));
     }
-
-    VkImageSubresource subResourceCr = {0};
-    subResourceCr.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    vkGetImageSubresourceLayout((*e).device, (*e).ycbcr.cr, &subResourceCr, layoutCr);
 }
 
-void memoryMapCb(const Elham *e, const char **cbData, VkSubresourceLayout *layoutCb) {
-    if (vkMapMemory((*e).device, (*e).ycbcr.cbMemory, 0, VK_WHOLE_SIZE, 0, (void **) cbData) != VK_SUCCESS) {
-        printf("Failed to map memory for Cb image.");
-        exit(EXIT_FAILURE);
-    }
+void destroyFrame(Elham *e, Frame *f) {
+    VkDevice device = e->device;
 
-    VkImageSubresource subResourceCb = {0};
-    subResourceCb.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    vkGetImageSubresourceLayout((*e).device, (*e).ycbcr.cb, &subResourceCb, layoutCb);
+    vkDestroyBuffer(device, f->transform, NULL);
+    freeAllocation(e, &f->transformMemory);
+    vkDestroyQueryPool(device, f->queries, NULL);
+
+    vkDestroySemaphore(device, f->timeline, NULL);
+    vkDestroySemaphore(device, f->copied, NULL);
+    vkDestroySemaphore(device, f->rendered, NULL);
+    vkDestroyFence(device, f->ycbcr.fence, NULL);
+    vkDestroyFence(device, f->copyFence, NULL);
+    vkDestroyFence(device, f->renderFence, NULL);
+
+    vkDestroyImageView(device, f->ycbcr.inputView, NULL);
+    vkDestroyImageView(device, f->ycbcr.yView, NULL);
+    vkDestroyImageView(device, f->ycbcr.cbView, NULL);
+    vkDestroyImageView(device, f->ycbcr.crView, NULL);
+    vkDestroyImage(device, f->ycbcr.y, NULL);
+    freeAllocation(e, &f->ycbcr.yMemory);
+    vkDestroyImage(device, f->ycbcr.cb, NULL);
+    freeAllocation(e, &f->ycbcr.cbMemory);
+    vkDestroyImage(device, f->ycbcr.cr, NULL);
+    freeAllocation(e, &f->ycbcr.crMemory);
+    vkDestroyBuffer(device, f->ycbcr.readback, NULL);
+    freeAllocation(e, &f->ycbcr.readbackMemory);
+    free(f->ycbcr.host);
+
+    vkDestroyFramebuffer(device, f->framebuffer, NULL);
+    vkDestroyImageView(device, f->srcImageView, NULL);
+    vkDestroyImage(device, f->srcImage, NULL);
+    freeAllocation(e, &f->srcImageMemory);
+
+    vkDestroyImage(device, f->dstImage, NULL);
+    freeAllocation(e, &f->dstImageMemory);
 }
 
-void memoryMApY(const Elham *e, const char **yData, VkSubresourceLayout *layout) {
-    if (vkMapMemory((*e).device, (*e).ycbcr.yMemory, 0, VK_WHOLE_SIZE, 0, (void **) yData) != VK_SUCCESS) {
-        printf("Failed to map memory for Y' image.");
-        exit(EXIT_FAILURE);
-    }
+// Destroys what a stream owns, the device and everything on it stay for the other streams.
+void destroyStream(Elham *e) {
+    VkDevice device = e->device;
 
-    VkImageSubresource subResourceY = {0};
-    subResourceY.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    vkGetImageSubresourceLayout((*e).device, (*e).ycbcr.y, &subResourceY, layout);
+    vkDeviceWaitIdle(device);
+    destroyCommands(e);
+    for (uint32_t i = 0; i < e->frameCount; i++) {
+        destroyFrame(e, e->frames + i);
+    }
+    free(e->frames);
+    e->frames = NULL;
+    vkDestroyBuffer(device, e->ycbcr.conversion, NULL);
+    freeAllocation(e, &e->ycbcr.conversionMemory);
+    cpuDestroyConverter(e);
+    vkDestroyCommandPool(device, e->ycbcr.commandPool, NULL);
+    vkDestroyDescriptorPool(device, e->ycbcr.descriptorPool, NULL);
+    vkDestroyDescriptorPool(device, e->transformPool, NULL);
+    vkDestroyCommandPool(device, e->commandPool, NULL);
 }
 
+// Destroys the stream that owns the device, after every stream that borrows it has been destroyed.
 void cleanup(Elham *e) {
     VkDevice device = e->device;
     VkInstance instance = e->instance;
 
+    printf("Memory: %u blocks, %llu KiB reserved, %llu KiB peak in use.\n", e->arena->blockCount,
+           (unsigned long long) (e->arena->reserved >> 10), (unsigned long long) (e->arena->peakInUse >> 10));
     printf("Cleaning up...");
-    vkDestroyBuffer(device, e->vertexBuffer, NULL);
-
-    vkFreeMemory(device, e->vertexBufferMemory, NULL);
-
-    vkDestroyFence(device, e->copyFence, NULL);
-    vkDestroyFence(device, e->renderFence, NULL);
+    destroyStream(e);
+    destroyScene(e);
+    destroyMemoryArena(e);
+    savePipelineCache(e);
+    vkDestroyPipelineCache(device, e->pipelineCache, NULL);
+    free(e->pipelineCachePath);
 
-    vkFreeMemory(device, e->ycbcr.yMemory, NULL);
-    vkDestroyImage(device, e->ycbcr.y, NULL);
+    vkDestroyPipeline(device, e->ycbcr.pipeline, NULL);
+    vkDestroyPipelineLayout(device, e->ycbcr.pipelineLayout, NULL);
+    vkDestroyDescriptorSetLayout(device, e->ycbcr.descriptorSetLayout, NULL);
 
-    vkDestroyImage(device, e->srcImage, NULL);
-    vkFreeMemory(device, e->srcImageMemory, NULL);
-
-    vkDestroyImage(device, e->dstImage, NULL);
-    vkFreeMemory(device, e->dstImageMemory, NULL);
-
-    vkDestroyCommandPool(device, e->commandPool, NULL);
-    vkDestroyFramebuffer(device, e->framebuffer, NULL);
-    vkDestroyImageView(device, e->srcImageView, NULL);
     vkDestroyPipeline(device, e->pipeline, NULL);
     vkDestroyRenderPass(device, e->renderPass, NULL);
     vkDestroyPipelineLayout(device, e->pipelineLayout, NULL);
+    vkDestroyDescriptorSetLayout(device, e->transformLayout, NULL);
     vkDestroyShaderModule(device, e->vertShader, NULL);
     vkDestroyShaderModule(device, e->fragShader, NULL);
     vkDestroyShaderModule(device, e->ycbcr.shader, NULL);
@@ -1497,101 +3652,230 @@ void cleanup(Elham *e) {
     printf("done.\n");
 }
 
-void ycbcrCreateCommandBuffer(Elham *e) {
+void ycbcrCreateCommandPool(Elham *e) {
     VkCommandPoolCreateInfo cmdPoolInfo = {0};
     cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    cmdPoolInfo.flags = 0;
+    // ElhamBench records the Y'CbCr buffers again to time it, see benchmarkRecording()
+    cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
     cmdPoolInfo.queueFamilyIndex = e->ycbcr.queueFamilyIndex;
     VK_CHECK_RESULT(vkCreateCommandPool(e->device, &cmdPoolInfo, NULL, &e->ycbcr.commandPool))
+}
 
-    VkCommandBufferAllocateInfo cmdBuffIno = {0};
-    cmdBuffIno.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmdBuffIno.commandPool = e->ycbcr.commandPool;
-    cmdBuffIno.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cmdBuffIno.commandBufferCount = 1;
-    VK_CHECK_RESULT(vkAllocateCommandBuffers(e->device, &cmdBuffIno, &e->ycbcr.commandBuffer))
-    VkCommandBuffer buff = e->ycbcr.commandBuffer;
+/*
+ * Copies the device-local planes into the frame's readback buffer, back to back at their sample size, so the encoder
+ * can take it as is. The planes hold the rows of band, which go where they are in the frame.
+ */
+void ycbcrRecordReadback(Elham *e, Frame *f, VkCommandBuffer buff, uint32_t band) {
+    VkImage planes[3] = {f->ycbcr.y, f->ycbcr.cb, f->ycbcr.cr};
+    VkDeviceSize offset = 0;
+    for (uint32_t i = 0; i < planeCount(e); i++) {
+        insertImageMemoryBarrier(
+            buff,
+            planes[i],
+            VK_ACCESS_SHADER_WRITE_BIT,
+            VK_ACCESS_TRANSFER_READ_BIT,
+            VK_IMAGE_LAYOUT_GENERAL,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+        VkBufferImageCopy region = {0};
+        region.bufferOffset = offset + (VkDeviceSize) band * bandRows(e, i) * planeWidth(e, i) * sampleSize(e);
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent.width = planeWidth(e, i);
+        region.imageExtent.height = bandRows(e, i);
+        region.imageExtent.depth = 1;
+        vkCmdCopyImageToBuffer(buff, planes[i], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, f->ycbcr.readback, 1, &region);
+        offset += planeSize(e, i);
+    }
 
-    VkCommandBufferBeginInfo beginInfo = {0};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    VK_CHECK_RESULT(vkBeginCommandBuffer(buff, &beginInfo))
+    VkBufferMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = f->ycbcr.readback;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 1, &barrier, 0, NULL);
+}
+
+// The packed kernel writes the frame's readback buffer directly, there are no planes to copy.
+void ycbcrRecordPacked(Elham *e, Frame *f, VkCommandBuffer buff) {
+    uint32_t size[2] = {e->width, e->height};
+    vkCmdPushConstants(buff, e->ycbcr.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(size), size);
+
+    beginTimestamp(e, f, buff, STAGE_YCBCR, 0);
+    vkCmdDispatch(buff, e->width / 8 / e->ycbcr.workgroup[0], e->height / 2 / e->ycbcr.workgroup[1], 1);
+    endTimestamp(e, f, buff, STAGE_YCBCR, 0);
 
+    VkBufferMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = f->ycbcr.readback;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 1, &barrier,
+                         0, NULL);
+}
+
+// Converts the rows of band the render target holds, and reads them back with device-local planes.
+void ycbcrRecordBand(Elham *e, Frame *f, VkCommandBuffer buff, uint32_t band) {
     vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_COMPUTE, e->ycbcr.pipeline);
-    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_COMPUTE, e->ycbcr.pipelineLayout, 0, 1, &e->ycbcr.descriptorSet, 0, NULL);
+    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_COMPUTE, e->ycbcr.pipelineLayout, 0, 1, &f->ycbcr.descriptorSet, 0, NULL);
+
+    if (e->directInput) {
+        // the render pass left the source image in GENERAL, make its color writes visible to the shader
+        insertImageMemoryBarrier(
+            buff,
+            (*f).srcImage,
+            VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+            VK_ACCESS_SHADER_READ_BIT,
+            VK_IMAGE_LAYOUT_GENERAL,
+            VK_IMAGE_LAYOUT_GENERAL,
+            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    }
 
-    insertImageMemoryBarrier(
-        buff,
-        (*e).ycbcr.y,
-        VK_ACCESS_SHADER_WRITE_BIT,
-        0,
-        VK_IMAGE_LAYOUT_UNDEFINED,
-        VK_IMAGE_LAYOUT_GENERAL,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    if (e->ycbcr.kernel == KERNEL_PACKED) {
+        ycbcrRecordPacked(e, f, buff);
+        return;
+    }
 
+    // not before the band before has been read back
+    VkPipelineStageFlags previous = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
     insertImageMemoryBarrier(
         buff,
-        (*e).ycbcr.cb,
+        (*f).ycbcr.y,
         VK_ACCESS_SHADER_WRITE_BIT,
         0,
         VK_IMAGE_LAYOUT_UNDEFINED,
         VK_IMAGE_LAYOUT_GENERAL,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        previous,
         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 
     insertImageMemoryBarrier(
         buff,
-        (*e).ycbcr.cr,
+        (*f).ycbcr.cb,
         VK_ACCESS_SHADER_WRITE_BIT,
         0,
         VK_IMAGE_LAYOUT_UNDEFINED,
         VK_IMAGE_LAYOUT_GENERAL,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        previous,
         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 
-    vkCmdDispatch(buff, (*e).width / 2, (*e).height / 2, 1);
-
-    insertImageMemoryBarrier(
-        buff,
-        (*e).ycbcr.cb,
-        0,
-        VK_ACCESS_MEMORY_READ_BIT,
-        VK_IMAGE_LAYOUT_GENERAL,
-        VK_IMAGE_LAYOUT_GENERAL,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    if (planeCount(e) == 3) {
+        insertImageMemoryBarrier(
+            buff,
+            (*f).ycbcr.cr,
+            VK_ACCESS_SHADER_WRITE_BIT,
+            0,
+            VK_IMAGE_LAYOUT_UNDEFINED,
+            VK_IMAGE_LAYOUT_GENERAL,
+            previous,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    }
 
-    insertImageMemoryBarrier(
-        buff,
-        (*e).ycbcr.cr,
-        0,
-        VK_ACCESS_MEMORY_READ_BIT,
-        VK_IMAGE_LAYOUT_GENERAL,
-        VK_IMAGE_LAYOUT_GENERAL,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    beginTimestamp(e, f, buff, STAGE_YCBCR, band);
+    vkCmdDispatch(buff, e->rect.extent.width / 2 / e->ycbcr.workgroup[0],
+                  e->rect.extent.height / 2 / e->ycbcr.workgroup[1], 1);
+    endTimestamp(e, f, buff, STAGE_YCBCR, band);
+
+    if (e->deviceLocalPlanes) {
+        beginTimestamp(e, f, buff, STAGE_READBACK, band);
+        ycbcrRecordReadback(e, f, buff, band);
+        endTimestamp(e, f, buff, STAGE_READBACK, band);
+    } else {
+        insertImageMemoryBarrier(
+            buff,
+            (*f).ycbcr.cb,
+            0,
+            VK_ACCESS_MEMORY_READ_BIT,
+            VK_IMAGE_LAYOUT_GENERAL,
+            VK_IMAGE_LAYOUT_GENERAL,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+        if (planeCount(e) == 3) {
+            insertImageMemoryBarrier(
+                buff,
+                (*f).ycbcr.cr,
+                0,
+                VK_ACCESS_MEMORY_READ_BIT,
+                VK_IMAGE_LAYOUT_GENERAL,
+                VK_IMAGE_LAYOUT_GENERAL,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+        }
 
-    insertImageMemoryBarrier(
-        buff,
-        (*e).ycbcr.y,
-        0,
-        VK_ACCESS_MEMORY_READ_BIT,
-        VK_IMAGE_LAYOUT_GENERAL,
-        VK_IMAGE_LAYOUT_GENERAL,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+        insertImageMemoryBarrier(
+            buff,
+            (*f).ycbcr.y,
+            0,
+            VK_ACCESS_MEMORY_READ_BIT,
+            VK_IMAGE_LAYOUT_GENERAL,
+            VK_IMAGE_LAYOUT_GENERAL,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    }
+}
 
+void ycbcrRecordCommandBuffer(Elham *e, Frame *f, VkCommandBuffer buff) {
+    VkCommandBufferBeginInfo beginInfo = {0};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    VK_CHECK_RESULT(vkBeginCommandBuffer(buff, &beginInfo))
+    ycbcrRecordBand(e, f, buff, 0);
     VK_CHECK_RESULT(vkEndCommandBuffer(buff)) // end recording commands.
 }
 
-void ycbcrCreateDescriptorSet(Elham *e) {
-    VkDevice device = e->device;
+/*
+ * Renders, converts and reads back a frame one band of rows at a time, so the render target and planes on the device
+ * are only a band high. Everything goes into this one graphics command buffer: band b + 1 is rendered into the same
+ * target once band b's conversion has read it, which the render pass's external dependency waits for, and converted
+ * once band b's planes are read back. scenes has the draws of every band.
+ */
+void recordBands(Elham *e, Frame *f, VkCommandBuffer buffer, VkCommandBuffer const *scenes) {
+    VkCommandBufferBeginInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    VK_CHECK_RESULT(vkBeginCommandBuffer(buffer, &info))
 
-    e->ycbcr.format = VK_FORMAT_R8_UNORM;
+    for (uint32_t band = 0; band < e->bands; band++) {
+        beginTimestamp(e, f, buffer, STAGE_RENDER, band);
+        recordRenderPass(e, f, buffer, scenes[band]);
+        endTimestamp(e, f, buffer, STAGE_RENDER, band);
+        ycbcrRecordBand(e, f, buffer, band);
+    }
 
-    createYImage(e);
-    createCbImage(e);
-    createCrImage(e);
+    VK_CHECK_RESULT(vkEndCommandBuffer(buffer))
+}
+
+void ycbcrCreateConversion(Elham *e) {
+    ColorFormat const *color = &e->color;
+
+    printf("Create Y'CbCr conversion to %s, BT.%s, %s range, %u bits...", pixelFormats[color->format].name,
+           colorMatrices[color->matrix].name, color->fullRange ? "full" : "limited", color->depth);
+    VkBufferCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = sizeof(Conversion);
+    info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (vkCreateBuffer(e->device, &info, NULL, &e->ycbcr.conversion) != VK_SUCCESS) {
+        printf("failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    allocateBuffer(e, e->ycbcr.conversion, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, 0, &e->ycbcr.conversionMemory);
+    fillConversion(e, (Conversion *) e->ycbcr.conversionMemory.data);
+    flushAllocation(e, &e->ycbcr.conversionMemory);
+    printf("done.\n");
+}
+
+void ycbcrCreateDescriptorSetLayout(Elham *e) {
+    VkDevice device = e->device;
 
     // layout
     VkDescriptorSetLayoutBinding in = {0};
@@ -1618,57 +3902,157 @@ void ycbcrCreateDescriptorSet(Elham *e) {
     cr.descriptorCount = 1;
     cr.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 
-    VkDescriptorSetLayoutBinding bindings[4] = {in, y, cb, cr};
+    VkDescriptorSetLayoutBinding packed = {0};
+    packed.binding = 4;
+    packed.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    packed.descriptorCount = 1;
+    packed.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutBinding conversion = {0};
+    conversion.binding = 5;
+    conversion.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    conversion.descriptorCount = 1;
+    conversion.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutBinding bindings[5] = {in, y, cb, cr, conversion};
+    VkDescriptorSetLayoutBinding packedBindings[3] = {in, packed, conversion};
     VkDescriptorSetLayoutCreateInfo info = {0};
     info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    info.bindingCount = 4;
-    info.pBindings = bindings;
+    if (e->ycbcr.kernel == KERNEL_PACKED) {
+        info.bindingCount = 3;
+        info.pBindings = packedBindings;
+    } else {
+        info.bindingCount = 5;
+        info.pBindings = bindings;
+    }
     VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &info, NULL, &e->ycbcr.descriptorSetLayout))
+}
 
-    // pool
-    VkDescriptorPool pool;
-    VkDescriptorPoolSize poolSize = {0};
-    poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    poolSize.descriptorCount = 4;
+// One set per frame in flight, every stream has its own pool.
+void ycbcrCreateDescriptorPool(Elham *e) {
+    VkDevice device = e->device;
+
+    VkDescriptorPoolSize poolSizes[3] = {0};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    poolSizes[0].descriptorCount = (e->ycbcr.kernel == KERNEL_PACKED ? 1 : 4) * e->frameCount;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    poolSizes[1].descriptorCount = e->frameCount;
+    poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[2].descriptorCount = e->frameCount;
     VkDescriptorPoolCreateInfo poolInfo = {0};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    poolInfo.maxSets = 1;
-    poolInfo.poolSizeCount = 1;
-    poolInfo.pPoolSizes = &poolSize;
-    VK_CHECK_RESULT(vkCreateDescriptorPool(device, &poolInfo, NULL, &pool))
+    poolInfo.maxSets = e->frameCount;
+    poolInfo.poolSizeCount = e->ycbcr.kernel == KERNEL_PACKED ? 3 : 2;
+    poolInfo.pPoolSizes = poolSizes;
+    VK_CHECK_RESULT(vkCreateDescriptorPool(device, &poolInfo, NULL, &e->ycbcr.descriptorPool))
+}
+
+void ycbcrCreatePackedDescriptorSet(Elham *e, Frame *f) {
+    createReadbackBuffer(e, f);
+
+    VkDescriptorSetAllocateInfo allocInfo = {0};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = e->ycbcr.descriptorPool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &e->ycbcr.descriptorSetLayout;
+    VK_CHECK_RESULT(vkAllocateDescriptorSets(e->device, &allocInfo, &f->ycbcr.descriptorSet))
+
+    createInImageView(e, f);
+    VkDescriptorImageInfo inInfo = {0};
+    inInfo.imageView = f->ycbcr.inputView;
+    inInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkDescriptorBufferInfo planesInfo = {0};
+    planesInfo.buffer = f->ycbcr.readback;
+    planesInfo.offset = 0;
+    planesInfo.range = VK_WHOLE_SIZE;
+
+    VkDescriptorBufferInfo conversionInfo = {0};
+    conversionInfo.buffer = e->ycbcr.conversion;
+    conversionInfo.offset = 0;
+    conversionInfo.range = VK_WHOLE_SIZE;
+
+    VkWriteDescriptorSet writes[3] = {0};
+    writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[0].dstSet = f->ycbcr.descriptorSet;
+    writes[0].dstBinding = 0;
+    writes[0].descriptorCount = 1;
+    writes[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writes[0].pImageInfo = &inInfo;
+    writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[1].dstSet = f->ycbcr.descriptorSet;
+    writes[1].dstBinding = 4;
+    writes[1].descriptorCount = 1;
+    writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[1].pBufferInfo = &planesInfo;
+    writes[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[2].dstSet = f->ycbcr.descriptorSet;
+    writes[2].dstBinding = 5;
+    writes[2].descriptorCount = 1;
+    writes[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    writes[2].pBufferInfo = &conversionInfo;
+    vkUpdateDescriptorSets(e->device, 3, writes, 0, NULL);
+}
+
+void ycbcrCreateDescriptorSet(Elham *e, Frame *f) {
+    VkDevice device = e->device;
+
+    if (e->ycbcr.kernel == KERNEL_PACKED) {
+        ycbcrCreatePackedDescriptorSet(e, f);
+        return;
+    }
+
+    createYImage(e, f);
+    createCbImage(e, f);
+    if (planeCount(e) == 3) {
+        createCrImage(e, f);
+    }
+    if (e->deviceLocalPlanes) {
+        createReadbackBuffer(e, f);
+    }
 
     // set
     VkDescriptorSetAllocateInfo allocInfo = {0};
     allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    allocInfo.descriptorPool = pool;
+    allocInfo.descriptorPool = e->ycbcr.descriptorPool;
     allocInfo.descriptorSetCount = 1;
     allocInfo.pSetLayouts = &e->ycbcr.descriptorSetLayout;
-    VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &e->ycbcr.descriptorSet))
+    VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &f->ycbcr.descriptorSet))
 
-    createInImageView(e);
+    createInImageView(e, f);
     VkDescriptorImageInfo inInfo = {0};
-    inInfo.imageView = (*e).ycbcr.inputView;
+    inInfo.imageView = (*f).ycbcr.inputView;
     inInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
-    createYImageView(e);
+    createYImageView(e, f);
     VkDescriptorImageInfo yInfo = {0};
-    yInfo.imageView = (*e).ycbcr.yView;
+    yInfo.imageView = (*f).ycbcr.yView;
     yInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-    createCbImageView(e);
+    createCbImageView(e, f);
 
     VkDescriptorImageInfo cbInfo = {0};
-    cbInfo.imageView = (*e).ycbcr.cbView;
+    cbInfo.imageView = (*f).ycbcr.cbView;
     cbInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
-    createCrImageView(e);
+    // NV12 has no Cr plane, but the binding still needs a valid view
     VkDescriptorImageInfo crInfo = {0};
-    crInfo.imageView = (*e).ycbcr.crView;
+    if (planeCount(e) == 3) {
+        createCrImageView(e, f);
+        crInfo.imageView = (*f).ycbcr.crView;
+    } else {
+        crInfo.imageView = (*f).ycbcr.cbView;
+    }
     crInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
+    VkDescriptorBufferInfo conversionInfo = {0};
+    conversionInfo.buffer = e->ycbcr.conversion;
+    conversionInfo.offset = 0;
+    conversionInfo.range = VK_WHOLE_SIZE;
+
     // init set (connect resources to bindings)
     VkWriteDescriptorSet writeI = {0};
     writeI.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writeI.dstSet = e->ycbcr.descriptorSet;
+    writeI.dstSet = f->ycbcr.descriptorSet;
     writeI.dstBinding = 0;
     writeI.descriptorCount = 1;
     writeI.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
@@ -1676,7 +4060,7 @@ void ycbcrCreateDescriptorSet(Elham *e) {
 
     VkWriteDescriptorSet writeY = {0};
     writeY.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writeY.dstSet = e->ycbcr.descriptorSet;
+    writeY.dstSet = f->ycbcr.descriptorSet;
     writeY.dstBinding = 1;
     writeY.descriptorCount = 1;
     writeY.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
@@ -1684,7 +4068,7 @@ void ycbcrCreateDescriptorSet(Elham *e) {
 
     VkWriteDescriptorSet writeCb = {0};
     writeCb.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writeCb.dstSet = e->ycbcr.descriptorSet;
+    writeCb.dstSet = f->ycbcr.descriptorSet;
     writeCb.dstBinding = 2;
     writeCb.descriptorCount = 1;
     writeCb.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
@@ -1692,14 +4076,53 @@ void ycbcrCreateDescriptorSet(Elham *e) {
 
     VkWriteDescriptorSet writeCr = {0};
     writeCr.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writeCr.dstSet = e->ycbcr.descriptorSet;
+    writeCr.dstSet = f->ycbcr.descriptorSet;
     writeCr.dstBinding = 3;
     writeCr.descriptorCount = 1;
     writeCr.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
     writeCr.pImageInfo = &crInfo;
 
-    VkWriteDescriptorSet writes[4] = {writeI, writeY, writeCb, writeCr};
-    vkUpdateDescriptorSets(device, 4, writes, 0, NULL);
+    VkWriteDescriptorSet writeConversion = {0};
+    writeConversion.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeConversion.dstSet = f->ycbcr.descriptorSet;
+    writeConversion.dstBinding = 5;
+    writeConversion.descriptorCount = 1;
+    writeConversion.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    writeConversion.pBufferInfo = &conversionInfo;
+
+    VkWriteDescriptorSet writes[5] = {writeI, writeY, writeCb, writeCr, writeConversion};
+    vkUpdateDescriptorSets(device, 5, writes, 0, NULL);
+}
+
+// Largest power of two up to limit that divides n, so that the dispatch covers the planes exactly.
+uint32_t dividingPowerOfTwo(uint32_t n, uint32_t limit) {
+    uint32_t size = 1;
+    while (size * 2 <= limit && n % (size * 2) == 0) {
+        size *= 2;
+    }
+    return size;
+}
+
+/*
+ * GPUs get 8x8 workgroups. CPU drivers such as lavapipe run a workgroup per thread and vectorise across invocations,
+ * so they get larger ones to cut the per-workgroup overhead.
+ */
+void ycbcrPickWorkgroupSize(Elham *e) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(e->gpu, &properties);
+    VkPhysicalDeviceLimits const *limits = &properties.limits;
+
+    uint32_t target = e->deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU ? 16 : 8;
+    uint32_t maxX = target < limits->maxComputeWorkGroupSize[0] ? target : limits->maxComputeWorkGroupSize[0];
+    uint32_t maxY = target < limits->maxComputeWorkGroupSize[1] ? target : limits->maxComputeWorkGroupSize[1];
+    uint32_t x = dividingPowerOfTwo(e->width / (e->ycbcr.kernel == KERNEL_PACKED ? 8 : 2), maxX);
+    uint32_t y = dividingPowerOfTwo(e->rect.extent.height / 2, maxY);
+    while (x * y > limits->maxComputeWorkGroupInvocations) {
+        if (x >= y) x /= 2; else y /= 2;
+    }
+    e->ycbcr.workgroup[0] = x;
+    e->ycbcr.workgroup[1] = y;
+    printf("Y'CbCr %s kernel, workgroup size %ux%u.\n", kernelNames[e->ycbcr.kernel], x, y);
 }
 
 void ycbcrCreatePipeline(Elham *e) {
@@ -1707,6 +4130,12 @@ void ycbcrCreatePipeline(Elham *e) {
     layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     layoutInfo.setLayoutCount = 1;
     layoutInfo.pSetLayouts = &e->ycbcr.descriptorSetLayout;
+    // width and height of the packed kernel
+    VkPushConstantRange size = {VK_SHADER_STAGE_COMPUTE_BIT, 0, 2 * sizeof(uint32_t)};
+    if (e->ycbcr.kernel == KERNEL_PACKED) {
+        layoutInfo.pushConstantRangeCount = 1;
+        layoutInfo.pPushConstantRanges = &size;
+    }
     VK_CHECK_RESULT(vkCreatePipelineLayout(e->device, &layoutInfo, NULL, &e->ycbcr.pipelineLayout))
 
     VkPipelineShaderStageCreateInfo stageInfo = {0};
@@ -1714,170 +4143,1511 @@ void ycbcrCreatePipeline(Elham *e) {
     stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
     stageInfo.module = e->ycbcr.shader;
     stageInfo.pName = "main";
+    // local_size_x_id = 0 and local_size_y_id = 1, then subsample_x, subsample_y and interleaved in ycbcr.comp
+    uint32_t constants[5] = {
+        e->ycbcr.workgroup[0],
+        e->ycbcr.workgroup[1],
+        pixelFormats[e->color.format].shiftX > 0 ? VK_TRUE : VK_FALSE,
+        pixelFormats[e->color.format].shiftY > 0 ? VK_TRUE : VK_FALSE,
+        pixelFormats[e->color.format].interleaved ? VK_TRUE : VK_FALSE
+    };
+    VkSpecializationMapEntry entries[5];
+    for (uint32_t i = 0; i < 5; i++) {
+        entries[i].constantID = i;
+        entries[i].offset = i * sizeof(uint32_t);
+        entries[i].size = sizeof(uint32_t);
+    }
+    VkSpecializationInfo specialization = {0};
+    specialization.mapEntryCount = 5;
+    specialization.pMapEntries = entries;
+    specialization.dataSize = sizeof(constants);
+    specialization.pData = constants;
+    stageInfo.pSpecializationInfo = &specialization;
     VkComputePipelineCreateInfo info = {0};
     info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     info.stage = stageInfo;
     info.layout = e->ycbcr.pipelineLayout;
-    VK_CHECK_RESULT(vkCreateComputePipelines(e->device, VK_NULL_HANDLE, 1, &info, NULL, &e->ycbcr.pipeline))
+    VK_CHECK_RESULT(vkCreateComputePipelines(e->device, e->pipelineCache, 1, &info, NULL, &e->ycbcr.pipeline))
 }
 
-void encode(Elham *e) {
+/*
+ * Records the command buffers of stage for every frame, none of which may be pending. The render stage records its
+ * secondaries first, a primary is no longer valid once what it executes is recorded again.
+ */
+void recordCommandSet(Elham *e, Stage stage) {
+    CommandSet *set = e->commands + stage;
+    for (uint32_t i = 0; i < e->frameCount; i++) {
+        Frame *f = e->frames + i;
+        switch (stage) {
+            case STAGE_RENDER: {
+                VkCommandBuffer const *scenes = set->secondaries + i * e->bands;
+                for (uint32_t band = 0; band < e->bands; band++) {
+                    recordSceneCommands(e, f, scenes[band], band);
+                }
+                if (e->bands > 1) {
+                    recordBands(e, f, set->buffers[i], scenes);
+                } else {
+                    recordRenderCommands(e, f, set->buffers[i], scenes[0]);
+                }
+                break;
+            }
+            case STAGE_COPY:
+                recordCopyCommand(e, f, set->buffers[i]);
+                break;
+            default:
+                ycbcrRecordCommandBuffer(e, f, set->buffers[i]);
+                break;
+        }
+    }
+}
 
+/*
+ * Records the render, copy and Y'CbCr commands of every frame once, as far as the stream runs those stages, and points
+ * the frames at them. Nothing in them changes while the stream lives, so the render loop only resubmits them.
+ */
+void recordCommands(Elham *e) {
+    // bands are converted by the render commands
+    bool converted = e->ycbcr.kernel == KERNEL_CPU || e->bands > 1;
+    bool used[] = {[STAGE_RENDER] = true, [STAGE_COPY] = !e->directInput, [STAGE_YCBCR] = !converted};
+    for (Stage stage = 0; stage <= STAGE_YCBCR; stage++) {
+        if (!used[stage]) {
+            continue;
+        }
+        printf("Record %s commands%s...", stageNames[stage], stage == STAGE_RENDER && e->bands > 1 ? " in bands" : "");
+        CommandSet *set = e->commands + stage;
+        VkCommandPool pool = stage == STAGE_YCBCR ? e->ycbcr.commandPool : e->commandPool;
+        set->buffers = allocateCommandBuffers(e, pool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, e->frameCount);
+        set->secondaries = NULL;
+        if (stage == STAGE_RENDER) {
+            set->secondaries = allocateCommandBuffers(e, pool, VK_COMMAND_BUFFER_LEVEL_SECONDARY, e->frameCount * e->bands);
+        }
+        recordCommandSet(e, stage);
+        printf("done.\n");
+    }
+    for (uint32_t i = 0; i < e->frameCount; i++) {
+        Frame *f = e->frames + i;
+        f->renderCommandBuffer = e->commands[STAGE_RENDER].buffers[i];
+        f->copyCommandBuffer = used[STAGE_COPY] ? e->commands[STAGE_COPY].buffers[i] : VK_NULL_HANDLE;
+        f->ycbcr.commandBuffer = used[STAGE_YCBCR] ? e->commands[STAGE_YCBCR].buffers[i] : VK_NULL_HANDLE;
+    }
 }
 
-int main(int argc, const char *argv[]) {
-    Elham e;
-    char const *vertexShader = "shaders/vert.spv";
-    char const *fragmentShader = "shaders/frag.spv";
-    char const *ycbcrShader = "shaders/ycbcr.spv";
+void createFrame(Elham *e, Frame *f) {
+    createQueryPool(e, f);
 
-    e.format = VK_FORMAT_R8G8B8A8_UNORM;
-    e.callback = saveRaw;
+    // Render
+    createSrcImage(e, f);
+    createImageView(e, f);
+    createFramebuffer(e, f);
+    createTransform(e, f);
 
-    setDimensions(&e, width, height);
+    // Copy
+    if (!e->directInput) {
+        createDstImage(e, f);
+    }
 
-    // Vulkan
-    createInstance(&e);
-    pickPhysicalDevice(&e);
-    pickGraphicsQueueFamily(&e);
-    pickComputeQueueFamily(&e);
-    createDevice(&e);
+    createFences(e, f);
 
-    // Render
-    createRenderPass(&e);
-    createSrcImage(&e);
+    // Y'CbCr
+    if (e->ycbcr.kernel == KERNEL_CPU) {
+        f->ycbcr.host = malloc(frameSize(e));
+    } else {
+        ycbcrCreateDescriptorSet(e, f);
+    }
 
-    createImageView(&e);
-    createFramebuffer(&e);
+    f->pending = false;
+}
+
+void createFrames(Elham *e) {
+    printf("Create %u frame(s), %u in flight...\n", e->frameCount, e->inFlight);
+    e->frames = calloc(e->frameCount, sizeof(Frame));
+    for (uint32_t i = 0; i < e->frameCount; i++) {
+        createFrame(e, e->frames + i);
+    }
+    recordCommands(e);
+    printf("done.\n");
+}
+
+void mapPlanes(Elham *e, Frame *f, Planes *planes) {
+    if (e->deviceLocalPlanes || e->ycbcr.kernel != KERNEL_IMAGE) {
+        const char *data = (const char *) f->ycbcr.host;
+        if (e->ycbcr.kernel != KERNEL_CPU) {
+            Allocation const *a = &f->ycbcr.readbackMemory;
+            invalidateAllocation(e, a);
+            data = a->data;
+        }
+        planes->count = planeCount(e);
+        for (uint32_t i = 0; i < planes->count; i++) {
+            planes->data[i] = data;
+            planes->stride[i] = planeWidth(e, i) * sampleSize(e);
+            data += planeSize(e, i);
+        }
+        return;
+    }
+
+    Allocation const *allocations[3] = {&f->ycbcr.yMemory, &f->ycbcr.cbMemory, &f->ycbcr.crMemory};
+    planes->count = planeCount(e);
+    for (uint32_t i = 0; i < planes->count; i++) {
+        Allocation const *a = allocations[i];
+        invalidateAllocation(e, a);
+        planes->data[i] = a->data + a->layout.offset;
+        planes->stride[i] = a->layout.rowPitch;
+    }
+}
 
-    createCommandPool(&e);
-    createCommandBuffer(&e);
-    createPipelineLayout(&e);
+void backoff() {
+    struct timespec ts = {0, 100000};
+    nanosleep(&ts, NULL);
+}
+
+// Appends a picture's NALs to the stream with as few writev calls as possible.
+void writeNals(Encoder *enc, x265_nal const *nals, uint32_t count) {
+    // POSIX guarantees at least 16 for IOV_MAX
+    struct iovec iov[16];
+    uint32_t next = 0;
+    while (next < count) {
+        int n = 0;
+        for (; n < 16 && next + n < count; n++) {
+            iov[n].iov_base = nals[next + n].payload;
+            iov[n].iov_len = nals[next + n].sizeBytes;
+        }
+        next += n;
+
+        struct iovec *pending = iov;
+        while (n > 0) {
+            ssize_t written = writev(enc->output, pending, n);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                printf("Failed to write encoded stream: %s.\n", strerror(errno));
+                return;
+            }
+            // skip whatever went out completely, then resume in the middle of a partial NAL
+            while (n > 0 && (size_t) written >= pending->iov_len) {
+                written -= (ssize_t) pending->iov_len;
+                pending++;
+                n--;
+            }
+            if (n > 0) {
+                pending->iov_base = (char *) pending->iov_base + written;
+                pending->iov_len -= written;
+            }
+        }
+    }
+}
+
+void *encodeThread(void *arg) {
+    Encoder *enc = arg;
+    x265_nal *nals = NULL;
+    uint32_t count = 0;
+
+    for (;;) {
+        unsigned tail = atomic_load_explicit(&enc->tail, memory_order_relaxed);
+        if (tail == atomic_load_explicit(&enc->head, memory_order_acquire)) {
+            double start = now();
+            while (tail == atomic_load_explicit(&enc->head, memory_order_acquire)) {
+                // the producer closes only after publishing its last frame, so look at head once more
+                if (atomic_load_explicit(&enc->closed, memory_order_acquire) &&
+                    tail == atomic_load_explicit(&enc->head, memory_order_acquire)) {
+                    goto flush;
+                }
+                backoff();
+            }
+            enc->consumerStall += now() - start;
+        }
+
+        EncodeSlot *slot = enc->slots + tail % enc->depth;
+        for (int i = 0; i < 3; i++) {
+            enc->picIn->planes[i] = (void *) slot->planes.data[i];
+            enc->picIn->stride[i] = (int) slot->planes.stride[i];
+        }
+        // the slot is refilled once tail moves past it, keep what is still needed after that
+        unsigned number = slot->number;
+        enc->picIn->pts = number;
+        double start = now();
+        int ret = enc->api->encoder_encode(enc->encoder, &nals, &count, enc->picIn, enc->picOut);
+        if (enc->stats != NULL) {
+            record(enc->stats, (now() - start) * 1e3);
+        }
+        // x265 has copied the picture, the slot can be refilled and the frame rendered into again
+        atomic_store_explicit(&enc->tail, tail + 1, memory_order_release);
+
+        if (ret < 0) {
+            printf("Failed to encode frame #%05u: %d.\n", number, ret);
+        } else if (ret > 0) {
+            writeNals(enc, nals, count);
+            enc->encoded++;
+        }
+    }
+
+flush:
+    while (enc->api->encoder_encode(enc->encoder, &nals, &count, NULL, enc->picOut) > 0) {
+        writeNals(enc, nals, count);
+        enc->encoded++;
+    }
+    return NULL;
+}
+
+/*
+ * Opens the stream the encoder appends to, "-" being standard output. In that case progress messages are moved over to
+ * standard error so that they do not end up in the middle of the stream.
+ */
+int openOutput(char const *path) {
+    if (strcmp(path, "-") == 0) {
+        fflush(stdout);
+        int fd = dup(STDOUT_FILENO);
+        if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            printf("Failed to redirect standard output.\n");
+            exit(EXIT_FAILURE);
+        }
+        return fd;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Failed to open %s: %s.\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+void createEncoder(Elham *e, uint32_t depth, Options const *o) {
+    Encoder *enc = &e->encoder;
+
+    enc->output = openOutput(o->output);
+    printf("Create encoder with a queue of %u frame(s), writing to %s...", depth, o->output);
+    enc->api = x265_api_get((int) e->color.depth);
+    if (enc->api == NULL) {
+        printf("failed, x265 was built without %u-bit support.\n", e->color.depth);
+        exit(EXIT_FAILURE);
+    }
+    enc->param = enc->api->param_alloc();
+    if (enc->api->param_default_preset(enc->param, o->preset, o->tune) < 0) {
+        printf("failed, unknown preset %s or tune %s.\n", o->preset, o->tune ? o->tune : "(none)");
+        exit(EXIT_FAILURE);
+    }
+    enc->param->bRepeatHeaders = 1;
+    if (enc->api->param_parse(enc->param, "fps", o->fps) != 0) {
+        printf("failed, invalid fps %s.\n", o->fps);
+        exit(EXIT_FAILURE);
+    }
+    if (o->bitrate > 0) {
+        enc->param->rc.rateControlMode = X265_RC_ABR;
+        enc->param->rc.bitrate = (int) o->bitrate;
+    }
+    enc->param->sourceWidth = e->width;
+    enc->param->sourceHeight = e->height;
+    enc->param->internalBitDepth = (int) e->color.depth;
+    enc->param->internalCsp = pixelFormats[e->color.format].csp;
+
+    // signal what the Y'CbCr kernels actually produce
+    ColorFormat const *color = &e->color;
+    enc->api->param_parse(enc->param, "range", color->fullRange ? "full" : "limited");
+    enc->api->param_parse(enc->param, "colorprim", colorMatrices[color->matrix].primaries);
+    enc->api->param_parse(enc->param, "transfer", colorMatrices[color->matrix].transfer);
+    enc->api->param_parse(enc->param, "colormatrix", colorMatrices[color->matrix].matrix);
+    enc->api->param_parse(enc->param, "chromaloc", color->siting == CHROMA_LEFT ? "0" : "1");
+
+    enc->encoder = enc->api->encoder_open(enc->param);
+    if (enc->encoder == NULL) {
+        printf("failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    enc->picIn = enc->api->picture_alloc();
+    enc->api->picture_init(enc->param, enc->picIn);
+    enc->picIn->bitDepth = (int) e->color.depth;
+    enc->picIn->colorSpace = pixelFormats[e->color.format].csp;
+    enc->picOut = enc->api->picture_alloc();
+    enc->api->picture_init(enc->param, enc->picOut);
+
+    enc->depth = depth;
+    enc->slots = calloc(depth, sizeof(EncodeSlot));
+    for (uint32_t i = 0; i < depth && pixelFormats[e->color.format].interleaved; i++) {
+        enc->slots[i].data = malloc(frameSize(e));
+    }
+    atomic_init(&enc->head, 0);
+    atomic_init(&enc->tail, 0);
+    atomic_init(&enc->closed, false);
+    enc->producerStall = 0;
+    enc->consumerStall = 0;
+    enc->encoded = 0;
+    enc->stats = e->stats != NULL ? e->stats + STAGE_ENCODE : NULL;
+
+    if (pthread_create(&enc->thread, NULL, encodeThread, enc) != 0) {
+        printf("failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("done.\n");
+}
+
+// Splits the CbCr plane of an NV12 frame into the Cb and Cr planes of the I420 slot x265 reads.
+void copyNV12(Elham const *e, Planes const *planes, char *slot) {
+    uint32_t w = e->width / 2;
+    uint32_t h = e->height / 2;
+    char *cb = slot + planeSize(e, 0);
+    char *cr = cb + planeSize(e, 1) / 2;
+    for (uint32_t y = 0; y < h; y++) {
+        char const *row = planes->data[1] + y * planes->stride[1];
+        if (sampleSize(e) == 1) {
+            for (uint32_t x = 0; x < w; x++) {
+                cb[(size_t) y * w + x] = row[2 * x];
+                cr[(size_t) y * w + x] = row[2 * x + 1];
+            }
+        } else {
+            uint16_t const *pairs = (uint16_t const *) row;
+            uint16_t *cb16 = (uint16_t *) cb + (size_t) y * w;
+            uint16_t *cr16 = (uint16_t *) cr + (size_t) y * w;
+            for (uint32_t x = 0; x < w; x++) {
+                cb16[x] = pairs[2 * x];
+                cr16[x] = pairs[2 * x + 1];
+            }
+        }
+    }
+}
+
+/*
+ * Hands a converted frame's planes to the encoder through the next free slot of its queue, waiting only if the queue
+ * is full. The frame must not be rendered into again before reclaimFrame().
+ */
+void encode(Elham *e, Frame *f) {
+    Encoder *enc = &e->encoder;
+
+    unsigned head = atomic_load_explicit(&enc->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&enc->tail, memory_order_acquire) == enc->depth) {
+        double start = now();
+        while (head - atomic_load_explicit(&enc->tail, memory_order_acquire) == enc->depth) {
+            backoff();
+        }
+        enc->producerStall += now() - start;
+    }
+
+    EncodeSlot *slot = enc->slots + head % enc->depth;
+    double start = now();
+    mapPlanes(e, f, &slot->planes);
+    if (slot->planes.count == 2) {
+        Planes *planes = &slot->planes;
+        copyNV12(e, planes, slot->data);
+        // the luma plane stays where it is
+        planes->data[1] = slot->data + planeSize(e, 0);
+        planes->data[2] = planes->data[1] + planeSize(e, 1) / 2;
+        planes->stride[1] = planes->stride[2] = e->width / 2 * sampleSize(e);
+        planes->count = 3;
+    }
+    slot->number = f->number;
+    f->queued = true;
+    f->ticket = head;
+    if (e->stats != NULL) {
+        record(e->stats + STAGE_MAP, (now() - start) * 1e3);
+    }
+    atomic_store_explicit(&enc->head, head + 1, memory_order_release);
+}
+
+// Waits until the encoder is done with the planes encode() lent it from this frame.
+void reclaimFrame(Elham *e, Frame *f) {
+    Encoder *enc = &e->encoder;
+    if (!f->queued) {
+        return;
+    }
+    if ((int) (atomic_load_explicit(&enc->tail, memory_order_acquire) - f->ticket) <= 0) {
+        double start = now();
+        while ((int) (atomic_load_explicit(&enc->tail, memory_order_acquire) - f->ticket) <= 0) {
+            backoff();
+        }
+        enc->producerStall += now() - start;
+    }
+    f->queued = false;
+}
+
+void destroyEncoder(Elham *e) {
+    Encoder *enc = &e->encoder;
+
+    printf("Flushing encoder...");
+    atomic_store_explicit(&enc->closed, true, memory_order_release);
+    pthread_join(enc->thread, NULL);
+    printf("done.\n");
+    printf("Encoder: %u frame(s), queue of %u, producer stalled %.3f ms, consumer stalled %.3f ms.\n",
+           enc->encoded, enc->depth, enc->producerStall * 1e3, enc->consumerStall * 1e3);
+
+    for (uint32_t i = 0; i < enc->depth; i++) {
+        free(enc->slots[i].data);
+    }
+    free(enc->slots);
+    enc->api->picture_free(enc->picOut);
+    enc->api->picture_free(enc->picIn);
+    enc->api->encoder_close(enc->encoder);
+    enc->api->param_free(enc->param);
+    close(enc->output);
+}
+
+/*
+ * Times Y'CbCr conversion plus getting the planes to the host, reading every byte the way the encoder would, for the
+ * current plane layout. Build with and without ELHAM_DEVICE_LOCAL_PLANES to compare the two.
+ */
+void benchmarkYCbCr(Elham *e, unsigned iterations) {
+    Frame *f = e->frames;
+    frame(e, f);
+
+    double total = 0, best = INFINITY;
+    unsigned long checksum = 0;
+    for (unsigned n = 0; n < iterations; n++) {
+        double t = now();
+        if (e->ycbcr.kernel == KERNEL_CPU) {
+            process(e, f);
+        } else if (e->bands > 1) {
+            // converting bands means rendering them again
+            submit(f->renderCommandBuffer, e->graphicQueue, f->ycbcr.fence);
+            block(e->device, &f->ycbcr.fence);
+        } else {
+            submit(f->ycbcr.commandBuffer, e->ycbcr.queue, f->ycbcr.fence);
+            block(e->device, &f->ycbcr.fence);
+        }
+        Planes planes;
+        mapPlanes(e, f, &planes);
+        for (uint32_t i = 0; i < planes.count; i++) {
+            uint32_t w = planeWidth(e, i) * sampleSize(e);
+            uint32_t h = planeHeight(e, i);
+            for (uint32_t y = 0; y < h; y++) {
+                const unsigned char *row = (const unsigned char *) planes.data[i] + y * planes.stride[i];
+                for (uint32_t x = 0; x < w; x++) {
+                    checksum += row[x];
+                }
+            }
+        }
+        t = now() - t;
+        total += t;
+        if (t < best) best = t;
+    }
+    printf("Y'CbCr + readback%s (%s planes, %ux%u): avg %.3f ms, min %.3f ms over %u frames (checksum %lu).\n",
+           e->bands > 1 ? " + rendering, in bands" : "",
+           e->ycbcr.kernel != KERNEL_IMAGE ? kernelNames[e->ycbcr.kernel]
+                                           : e->deviceLocalPlanes ? "device-local" : "linear host-visible",
+           e->width, e->height,
+           total * 1e3 / iterations, best * 1e3, iterations, checksum);
+}
+
+/*
+ * Runs every vector version of the CPU converter this CPU supports against cpuRowsScalar() on pseudo-random pixels,
+ * I420 and NV12, both sitings and widths that are and are not multiples of the vector width. The planes are compared
+ * byte for byte, guard bytes past their end included. Returns how many cases differed.
+ */
+unsigned checkCpuRows(Elham const *e) {
+    struct {
+        char const *name;
+        cpu_rows_t rows;
+    } levels[2];
+    uint32_t levelCount = 0;
+#ifdef ELHAM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        levels[levelCount].name = "SSE4.1";
+        levels[levelCount++].rows = cpuRowsSSE4;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        levels[levelCount].name = "AVX2";
+        levels[levelCount++].rows = cpuRowsAVX2;
+    }
+#endif
+    if (levelCount == 0) {
+        printf("No vector CPU converter to check against the scalar one.\n");
+        return 0;
+    }
+
+    uint32_t const widths[] = {2, 4, 6, 8, 10, 12, 14, 16, 18, 22, 30, 34, 66};
+    uint32_t const height = 6;
+    uint32_t const guard = 64;
+    CpuTables t;
+    cpuFillTables(e, &t);
+    unsigned failures = 0;
+    for (uint32_t level = 0; level < levelCount; level++) {
+        unsigned cases = 0;
+        for (int siting = 0; siting < 2; siting++) {
+            t.siting = siting == 0 ? 1.0f : 0.5f;
+            t.notSiting = 1.0f - t.siting;
+            for (int interleaved = 0; interleaved < 2; interleaved++) {
+                for (uint32_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+                    uint32_t width = widths[w];
+                    size_t pitch = (size_t) width * 4;
+                    size_t size = (size_t) width * height * 3 / 2 + guard;
+                    uint8_t *rgba = malloc(pitch * height);
+                    uint8_t *expected = malloc(size);
+                    uint8_t *actual = malloc(size);
+                    // the extremes first, then an LCG
+                    uint32_t state = width;
+                    for (size_t i = 0; i < pitch * height; i++) {
+                        state = state * 1664525u + 1013904223u;
+                        rgba[i] = i < 4 ? 0 : i < 8 ? 255 : (uint8_t) (state >> 24);
+                    }
+                    memset(expected, 0x5a, size);
+                    memset(actual, 0x5a, size);
+
+                    CpuJob job = {0};
+                    job.rgba = rgba;
+                    job.pitch = pitch;
+                    job.width = width;
+                    job.height = height;
+                    job.interleaved = interleaved;
+                    job.y = expected;
+                    job.cb = job.y + (size_t) width * height;
+                    job.cr = job.cb + (size_t) width * height / 4;
+                    cpuRowsScalar(&t, &job, 0, height / 2);
+                    job.y = actual;
+                    job.cb = job.y + (size_t) width * height;
+                    job.cr = job.cb + (size_t) width * height / 4;
+                    levels[level].rows(&t, &job, 0, height / 2);
+
+                    for (size_t i = 0; i < size; i++) {
+                        if (expected[i] != actual[i]) {
+                            printf("%s CPU converter differs from the scalar one, %s, %s siting, width %u: byte %zu "
+                                   "is %u instead of %u.\n", levels[level].name, interleaved ? "nv12" : "i420",
+                                   siting == 0 ? "left" : "center", width, i, actual[i], expected[i]);
+                            failures++;
+                            break;
+                        }
+                    }
+                    cases++;
+                    free(actual);
+                    free(expected);
+                    free(rgba);
+                }
+            }
+        }
+        printf("Checked the %s CPU converter against the scalar one in %u cases.\n", levels[level].name, cases);
+    }
+    return failures;
+}
+
+/*
+ * Converts the first frame with the Y'CbCr kernel and with cpuRowsScalar() from a host copy of the same render target,
+ * and reports the samples that differ. Only for what both convert: whole 8-bit I420 or NV12 frames. Returns how many
+ * samples differed.
+ */
+unsigned checkYCbCr(Elham *e) {
+    if (e->ycbcr.kernel == KERNEL_CPU || e->bands > 1 || !cpuConvertible(&e->color)) {
+        printf("Not checking the Y'CbCr kernel against the CPU converter, that takes a kernel converting whole 8-bit "
+               "i420 or nv12 frames.\n");
+        return 0;
+    }
+    VkDevice device = e->device;
+    Frame *f = e->frames;
+    frame(e, f);
+    submit(f->ycbcr.commandBuffer, e->ycbcr.queue, f->ycbcr.fence);
+    block(device, &f->ycbcr.fence);
+
+    // the render target, as the kernel read it
+    VkDeviceSize pitch = (VkDeviceSize) e->width * 4;
+    VkBuffer rgba;
+    Allocation rgbaMemory;
+    VkBufferCreateInfo info = {0};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = pitch * e->height;
+    info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK_RESULT(vkCreateBuffer(device, &info, NULL, &rgba))
+    allocateBuffer(e, rgba, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT, &rgbaMemory);
+
+    VkCommandPool pool;
+    VkCommandPoolCreateInfo poolInfo = {0};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = e->graphicsQueueFamilyIndex;
+    VK_CHECK_RESULT(vkCreateCommandPool(device, &poolInfo, NULL, &pool))
+    VkCommandBuffer *buff = allocateCommandBuffers(e, pool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1);
+
+    VkCommandBufferBeginInfo beginInfo = {0};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK_RESULT(vkBeginCommandBuffer(buff[0], &beginInfo))
+    VkImageLayout layout = e->directInput ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    insertImageMemoryBarrier(
+        buff[0],
+        f->srcImage,
+        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        VK_ACCESS_TRANSFER_READ_BIT,
+        layout,
+        layout,
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT);
+    VkBufferImageCopy region = {0};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent.width = e->width;
+    region.imageExtent.height = e->height;
+    region.imageExtent.depth = 1;
+    vkCmdCopyImageToBuffer(buff[0], f->srcImage, layout, rgba, 1, &region);
+    VkMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(buff[0], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, NULL,
+                         0, NULL);
+    VK_CHECK_RESULT(vkEndCommandBuffer(buff[0]))
+
+    VkSubmitInfo submitInfo = {0};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = buff;
+    VK_CHECK_RESULT(vkQueueSubmit(e->graphicQueue, 1, &submitInfo, VK_NULL_HANDLE))
+    VK_CHECK_RESULT(vkQueueWaitIdle(e->graphicQueue))
+    vkDestroyCommandPool(device, pool, NULL);
+    free(buff);
+    invalidateAllocation(e, &rgbaMemory);
+
+    CpuTables t;
+    cpuFillTables(e, &t);
+    uint8_t *cpu = malloc(frameSize(e));
+    CpuJob job = {0};
+    job.rgba = (uint8_t const *) rgbaMemory.data;
+    job.pitch = pitch;
+    job.width = e->width;
+    job.height = e->height;
+    job.y = cpu;
+    job.cb = job.y + planeSize(e, 0);
+    job.cr = job.cb + planeSize(e, 1);
+    job.interleaved = pixelFormats[e->color.format].interleaved;
+    cpuRowsScalar(&t, &job, 0, e->height / 2);
+
+    Planes gpu;
+    mapPlanes(e, f, &gpu);
+    char const *names[3] = {"Y'", job.interleaved ? "CbCr" : "Cb", "Cr"};
+    uint8_t const *expected = cpu;
+    unsigned differences = 0;
+    for (uint32_t i = 0; i < gpu.count; i++) {
+        uint32_t w = planeWidth(e, i);
+        uint32_t h = planeHeight(e, i);
+        unsigned plane = 0;
+        int largest = 0;
+        for (uint32_t y = 0; y < h; y++) {
+            uint8_t const *row = (uint8_t const *) gpu.data[i] + y * gpu.stride[i];
+            for (uint32_t x = 0; x < w; x++) {
+                int difference = abs((int) row[x] - (int) expected[(size_t) y * w + x]);
+                if (difference == 0) {
+                    continue;
+                }
+                if (plane++ == 0) {
+                    printf("%s sample (%u, %u) is %u on the GPU and %u on the CPU.\n", names[i], x, y, row[x],
+                           expected[(size_t) y * w + x]);
+                }
+                if (difference > largest) largest = difference;
+            }
+        }
+        printf("%s: %u of %u samples differ between the %s kernel and the CPU converter, by at most %d.\n",
+               names[i], plane, w * h, kernelNames[e->ycbcr.kernel], largest);
+        differences += plane;
+        expected += planeSize(e, i);
+    }
+
+    free(cpu);
+    vkDestroyBuffer(device, rgba, NULL);
+    freeAllocation(e, &rgbaMemory);
+    return differences;
+}
+
+// Settings that follow from the options alone, before anything is created.
+void configure(Elham *e, Options const *o) {
+    e->format = VK_FORMAT_R8G8B8A8_UNORM;
+    e->callback = o->dumpRaw ? saveRaw : NULL;
+    e->inFlight = o->inFlight;
+    // as many again as the encoder queue holds, so that frames are not rendered into while it still reads them
+    e->frameCount = o->inFlight + o->queueDepth;
+    e->sync = ELHAM_TIMELINE_SEMAPHORES ? SYNC_TIMELINE : SYNC_FENCES;
+    e->directInput = ELHAM_DIRECT_YCBCR;
+    e->deviceLocalPlanes = ELHAM_DEVICE_LOCAL_PLANES;
+    if (o->dumpRaw && e->directInput && o->kernel != KERNEL_CPU) {
+        printf("Y'CbCr reads the render target directly, there is no RGBA copy to dump.\n");
+    }
+    e->color = o->color;
+    e->ycbcr.kernel = o->kernel;
+    if (e->ycbcr.kernel == KERNEL_PACKED && o->width % 8 != 0) {
+        printf("The packed Y'CbCr kernel needs a width that is a multiple of 8, using the image kernel.\n");
+        e->ycbcr.kernel = KERNEL_IMAGE;
+    }
+    if (e->ycbcr.kernel == KERNEL_PACKED && e->color.depth > 8) {
+        printf("The packed Y'CbCr kernel only writes 8-bit samples, using the image kernel.\n");
+        e->ycbcr.kernel = KERNEL_IMAGE;
+    }
+    if (e->ycbcr.kernel == KERNEL_PACKED && pixelFormats[e->color.format].shiftY == 0) {
+        printf("The packed Y'CbCr kernel only writes I420 and NV12, using the image kernel.\n");
+        e->ycbcr.kernel = KERNEL_IMAGE;
+    }
+    if (e->ycbcr.kernel == KERNEL_CPU && !cpuConvertible(&e->color)) {
+        printf("The CPU Y'CbCr converter only writes 8-bit I420 and NV12, using the image kernel.\n");
+        e->ycbcr.kernel = KERNEL_IMAGE;
+    }
+    if (e->ycbcr.kernel == KERNEL_CPU) {
+        useCpuKernel(e);
+    }
+    e->ycbcr.format = e->color.depth > 8 ? VK_FORMAT_R16_UNORM : VK_FORMAT_R8_UNORM;
+
+    e->bands = 1;
+    if (o->band > 0 && o->band < o->height) {
+        if (o->band % 2 != 0 || o->height % o->band != 0) {
+            printf("Bands of %u rows do not split %u rows evenly, converting whole frames.\n", o->band, o->height);
+        } else if (e->ycbcr.kernel != KERNEL_IMAGE || !e->directInput || !e->deviceLocalPlanes) {
+            printf("Bands need the image kernel, direct input and device-local planes, converting whole frames.\n");
+        } else {
+            e->bands = o->height / o->band;
+        }
+    }
+    setDimensions(e, o->width, o->height);
+    e->rect.extent.height = o->height / e->bands;
+}
+
+// What every stream has of its own: command pools, descriptors, conversion parameters, frames and the encoder.
+void createStream(Elham *e, Options const *o) {
+    createCommandPool(e);
+    createTransformPool(e);
+    if (e->ycbcr.kernel == KERNEL_CPU) {
+        cpuCreateConverter(e);
+    } else {
+        ycbcrCreateDescriptorPool(e);
+        ycbcrCreateConversion(e);
+    }
+    ycbcrCreateCommandPool(e);
+
+    createFrames(e);
+    createEncoder(e, o->queueDepth, o);
+}
+
+// Creates everything needed to render, convert and encode frames as the options say.
+void setup(Elham *e, Options const *o) {
+    char const *vertexShader = "vert.spv";
+    char const *fragmentShader = "frag.spv";
+    char const *ycbcrShader = "ycbcr.spv";
+
+    double start = now();
+    configure(e, o);
+
+    // Vulkan
+    createInstance(e);
+    pickPhysicalDevice(e, o->device);
+    // picking the device may have fallen back to the CPU converter
+    if (e->ycbcr.kernel == KERNEL_PACKED) {
+        ycbcrShader = "ycbcr_packed.spv";
+    } else if (e->color.depth > 8) {
+        ycbcrShader = "ycbcr16.spv";
+    }
+    pickGraphicsQueueFamily(e);
+    pickComputeQueueFamily(e);
+    pickSyncMode(e);
+    pickTimestamps(e);
+    createDevice(e);
+    createMemoryArena(e);
+    createPipelineCache(e, o->cacheDir);
+
+    // Render
+    createRenderPass(e);
+    createTransformLayout(e);
+    createPipelineLayout(e);
 
     printf("Create vertex shader...");
-    e.vertShader = createShader(e.device, vertexShader);
+    e->vertShader = createShader(e->device, o->shaders, vertexShader);
     printf("done.\n");
 
     printf("Create fragment shader...");
-    e.fragShader = createShader(e.device, fragmentShader);
+    e->fragShader = createShader(e->device, o->shaders, fragmentShader);
     printf("done.\n");
 
-    createPipeline(&e);
+    double pipelines = now();
+    createPipeline(e);
+    pipelines = now() - pipelines;
+    uint32_t count = o->instances;
+    Primitive *primitives = buildScene(&count);
+    createScene(e, primitives, count);
+    free(primitives);
 
-    createVertexBuffer(&e, 3);
-    recordRenderCommands(&e);
+    // Y'CbCr
+    if (e->ycbcr.kernel != KERNEL_CPU) {
+        ycbcrCreateDescriptorSetLayout(e);
+        printf("Create Y'CbCr shader...");
+        e->ycbcr.shader = createShader(e->device, o->shaders, ycbcrShader);
+        printf("done.\n");
+        ycbcrPickWorkgroupSize(e);
+        double compute = now();
+        ycbcrCreatePipeline(e);
+        pipelines += now() - compute;
+    }
 
-    // Copy
-    createDstImage(&e);
-    createCopyCommandBuffer(&e);
-    recordCopyCommand(&e);
+    createStream(e, o);
+    printf("Startup took %.1f ms, %.1f ms of it creating pipelines with a %s pipeline cache.\n",
+           (now() - start) * 1e3, pipelines * 1e3, e->warmCache ? "warm" : "cold");
+}
 
-    createFences(&e);
+/*
+ * Sets up another stream through the device of shared, which was set up with the same options but for the output:
+ * the instance, device, memory arena, render pass, pipelines and shaders are borrowed and only what createStream()
+ * makes is new, so a stream costs no instance, device or pipeline creation.
+ */
+void setupStream(Elham *e, Elham const *shared, Options const *o) {
+    configure(e, o);
+    e->shared = shared;
+    e->instance = shared->instance;
+    e->gpu = shared->gpu;
+    e->deviceType = shared->deviceType;
+    e->graphicsQueueFamilyIndex = shared->graphicsQueueFamilyIndex;
+    e->device = shared->device;
+    e->memoryProperties = shared->memoryProperties;
+    e->nonCoherentAtomSize = shared->nonCoherentAtomSize;
+    e->arena = shared->arena;
+    e->sync = shared->sync;
+    e->timestamps = shared->timestamps;
+    e->timestampPeriod = shared->timestampPeriod;
+    e->timestampMask = shared->timestampMask;
+    if (shared->ycbcr.kernel == KERNEL_CPU) {
+        useCpuKernel(e);
+    }
 
-    // Y'CbCr
-    ycbcrCreateDescriptorSet(&e);
-    printf("Create Y'CbCr shader...");
-    e.ycbcr.shader = createShader(e.device, ycbcrShader);
-    printf("done.\n");
-    ycbcrCreatePipeline(&e);
-    ycbcrCreateCommandBuffer(&e);
-    e.ycbcr.fence = createFence(e.device);
+    e->renderPass = shared->renderPass;
+    e->transformLayout = shared->transformLayout;
+    e->pipelineLayout = shared->pipelineLayout;
+    e->vertShader = shared->vertShader;
+    e->fragShader = shared->fragShader;
+    e->pipeline = shared->pipeline;
+    e->graphicQueue = shared->graphicQueue;
+    e->scene = shared->scene;
+
+    e->ycbcr.queue = shared->ycbcr.queue;
+    e->ycbcr.queueFamilyIndex = shared->ycbcr.queueFamilyIndex;
+    e->ycbcr.descriptorSetLayout = shared->ycbcr.descriptorSetLayout;
+    e->ycbcr.shader = shared->ycbcr.shader;
+    e->ycbcr.workgroup[0] = shared->ycbcr.workgroup[0];
+    e->ycbcr.workgroup[1] = shared->ycbcr.workgroup[1];
+    e->ycbcr.pipelineLayout = shared->ycbcr.pipelineLayout;
+    e->ycbcr.pipeline = shared->ycbcr.pipeline;
+
+    createStream(e, o);
+}
 
+void installSignalHandlers() {
     printf("Installing signal handler...");
-    signal(SIGINT | SIGHUP | SIGTERM, handleSigint);
+    signal(SIGINT, handleSigint);
+    signal(SIGHUP, handleSigint);
+    signal(SIGTERM, handleSigint);
     printf("done.\n");
+}
 
-    x265_param *param = x265_param_alloc();
-    x265_param_default_preset(param, "ultrafast", NULL);
-    param->bRepeatHeaders=1;
-    x265_param_parse(param, "fps", "60/1");
-    param->sourceWidth = e.width;
-    param->sourceHeight = e.height;
-    param->forceFlush = 1;
-    x265_encoder* encoder = x265_encoder_open(param);
-    x265_picture *picIn = x265_picture_alloc();
-    x265_picture_init(param, picIn);
-//    picIn->bitDepth = 24;
+// The stream that created the device e renders on.
+Elham const *deviceOwner(Elham const *e) {
+    return e->shared != NULL ? e->shared : e;
+}
+
+// Frames, frame rate and utilization of every device, the GPU time of its streams' frames per second of animation.
+void reportDevices(Elham const *streams, unsigned count, double elapsed) {
+    for (unsigned s = 0; s < count; s++) {
+        if (streams[s].shared != NULL) {
+            continue;
+        }
+        unsigned n = 0;
+        unsigned frames = 0;
+        double busy = 0;
+        for (unsigned t = s; t < count && deviceOwner(streams + t) == streams + s; t++) {
+            n++;
+            frames += atomic_load(&streams[t].encoder.head);
+            busy += streams[t].gpuBusy;
+        }
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(streams[s].gpu, &properties);
+        printf("%s: %u stream(s), %u frames, %.2f fps", properties.deviceName, n, frames, frames / elapsed);
+        if (streams[s].timestamps) {
+            printf(", GPU busy %.1f%%", 100 * busy / elapsed);
+        }
+        printf(".\n");
+    }
+}
 
+/*
+ * Renders, converts and encodes frames of count streams on one device until limit frames of each have been rendered
+ * (0 = no limit) or a signal asks to stop. With timeline semaphores the frames of all streams go out together, in one
+ * vkQueueSubmit per queue per round.
+ */
+void animate(Elham *streams, unsigned count, unsigned limit) {
     Vec2 center = {0, 0};
     float speed = 1.0f / 5; // full rotation in 5 frames
-    clock_t t;
-    printf("Entering animation...\n");
+    Elham *first = streams;
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(first->gpu, &properties);
+    printf("Entering animation of %u stream(s) on %s...\n", count, properties.deviceName);
+    SubmitBatch batch = createBatch(count);
     unsigned frames = 0;
-    while (!finished) {
-//        t = clock() / CLOCKS_PER_SEC;
-        for (unsigned i = 0; i < 3; i++) {
-            rotateVec2(center,  frames * speed, &(vertices[i].pos));
-        }
-        fillVertexBuffer(&e, vertices);
-        frame(&e);
-        ycbcr(&e);
-        // Encode
-        printf("Encoding frame #%05d...", frames);
-        const char *y;
-        VkSubresourceLayout layoutY;
-        memoryMApY(&e, &y, &layoutY);
-        const char *cb;
-        VkSubresourceLayout layoutCb;
-        memoryMapCb(&e, &cb, &layoutCb);
-        const char *cr;
-        VkSubresourceLayout layoutCr;
-        memoryMapCr(&e, &cr, &layoutCr);
-        // YUV420p = 8bpp for Y', 4bpp for Cb and Cr each = 1 byte every 2 pixels
-        picIn->stride[0] = layoutY.rowPitch;
-        picIn->stride[1] = layoutCb.rowPitch;
-        picIn->stride[2] = layoutCr.rowPitch;
-        picIn->planes[0] = y;
-        picIn->planes[1] = cb;
-        picIn->planes[2] = cr;
-        x265_nal *pNals=NULL;
-        uint32_t iNal=0;
-        printf("Here\n");
-        int ret = x265_encoder_encode(encoder,&pNals,&iNal,picIn,NULL);
-        if(ret == 1) {
-            printf("done\n");
-        } else if(ret == 0)  {
-            ret = x265_encoder_encode(encoder,&pNals,&iNal,NULL,NULL);
-            printf("ret2 = %d, iNal2 = %d \n", ret,  iNal);
-            if(ret == 1) {
-                char filename[] = "output/0000.h265";
-                sprintf(filename, "output/%04lu.h265", frames);
-                FILE *f = fopen(filename, "w");
-                for(int j=0; j < iNal; j++){
-                    fwrite(pNals[j].payload,1,pNals[j].sizeBytes,f);
-                    printf("%d\n",j);
-                    fclose(f);
-                }
-                printf("done\n");
+    // Frames that go by before the rings are full are not counted towards the steady-state frame rate.
+    unsigned encoded = 0;
+    unsigned warmup = first->frameCount * count;
+    double start = now();
+    while (!finished && (limit == 0 || frames < limit)) {
+        for (unsigned s = 0; s < count; s++) {
+            Elham *e = streams + s;
+            // The oldest frame still in flight makes room for this one, encode it.
+            Frame *oldest = e->frames + (frames + e->frameCount - e->inFlight) % e->frameCount;
+            if (oldest->pending) {
+                retireFrame(e, oldest);
+                encode(e, oldest);
+                if (++encoded == warmup) start = now();
+            }
+            // Lent to the encoder frameCount - inFlight frames ago, only waits if the encoder is further behind.
+            Frame *f = e->frames + (frames % e->frameCount);
+            reclaimFrame(e, f);
+
+            e->angle = fmodf(e->angle + frames * speed, 2 * (float) M_PI);
+            writeTransform(e, f, center, e->angle);
+            f->number = frames;
+            if (e->inFlight == 1 && e->sync == SYNC_FENCES) {
+                frame(e, f);
+                ycbcr(e, f);
+                collectTimestamps(e, f);
+                encode(e, f);
+                if (++encoded == warmup) start = now();
+            } else if (e->sync == SYNC_TIMELINE) {
+                batchFrame(&batch, e, f);
             } else {
-                printf("failed : %d\n", ret);
+                submitFrame(e, f);
             }
-        } else {
-            printf("failed : %d.\n", ret);
-        }
-//        for(int j=0; j < iNal; j++){
-//            fwrite(pNals[j].payload,1,pNals[j].sizeBytes,fp_dst);
-//        }
-//        while(1){
-//            ret=x265_encoder_encode(encoder,&pNals,&iNal,NULL,NULL);
-//            if(ret==0){
-//                break;
-//            }
-//            printf("Flush 1 frame.\n");
-//
-//            for(int j=0;j<iNal;j++){
-//                fwrite(pNals[j].payload,1,pNals[j].sizeBytes,fp_dst);
-//            }
-//        }
-
-        vkUnmapMemory(e.device, e.ycbcr.yMemory);
-        vkUnmapMemory(e.device, e.ycbcr.cbMemory);
-        vkUnmapMemory(e.device, e.ycbcr.crMemory);
-        postFrame();
+        }
+        flushBatch(deviceOwner(first), &batch);
         frames ++;
     }
 
+    // Drain the rings, oldest frame first.
+    for (unsigned i = 0; i < first->frameCount; i++) {
+        for (unsigned s = 0; s < count; s++) {
+            Elham *e = streams + s;
+            Frame *f = e->frames + ((frames + i) % e->frameCount);
+            if (f->pending) {
+                retireFrame(e, f);
+                encode(e, f);
+                if (++encoded == warmup) start = now();
+            }
+        }
+    }
+    destroyBatch(&batch);
+    if (encoded > warmup) {
+        double fps = (encoded - warmup) / (now() - start);
+        printf("%s: steady state %.2f fps over %u frames, %u frame(s) in flight%s, %s.\n",
+               properties.deviceName, fps, encoded - warmup, first->inFlight, first->inFlight > 1 ? "" : " (serial)",
+               first->sync == SYNC_TIMELINE ? "timeline semaphores" : "fences");
+        if (count > 1) {
+            printf("%u streams, %.2f fps each.\n", count, fps / count);
+        }
+    }
+}
+
+// The streams on one device, animated on a thread of their own so that no device waits for another, see animate().
+typedef struct {
+    Elham *streams;
+    unsigned count;
+    unsigned limit;
+    pthread_t thread;
+} Driver;
+
+void *driveDevice(void *arg) {
+    Driver *d = arg;
+    animate(d->streams, d->count, d->limit);
+    return NULL;
+}
+
+/*
+ * Animates every device's run of streams on its own thread, so that each device renders as fast as it can and the
+ * host work of its frames (retiring, NV12 copies, CPU conversion) runs next to that of the others.
+ */
+void animateDevices(Elham *streams, unsigned count, unsigned limit) {
+    Driver *drivers = calloc(count, sizeof(Driver));
+    unsigned driverCount = 0;
+    for (unsigned s = 0; s < count; s++) {
+        // every stream starts at its own angle so that no two render the same frames
+        streams[s].angle = 2 * (float) M_PI * s / count;
+        if (streams[s].shared == NULL) {
+            drivers[driverCount].streams = streams + s;
+            drivers[driverCount].limit = limit;
+            driverCount++;
+        }
+        drivers[driverCount - 1].count++;
+    }
+
+    double begin = now();
+    for (unsigned d = 0; d < driverCount; d++) {
+        if (pthread_create(&drivers[d].thread, NULL, driveDevice, drivers + d) != 0) {
+            printf("Failed to start the thread of device %u.\n", d);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (unsigned d = 0; d < driverCount; d++) {
+        pthread_join(drivers[d].thread, NULL);
+    }
+    reportDevices(streams, count, now() - begin);
+    free(drivers);
+}
+
+#ifdef ELHAM_BENCH
+
+int compareDoubles(void const *a, void const *b) {
+    double x = *(double const *) a;
+    double y = *(double const *) b;
+    return (x > y) - (x < y);
+}
+
+// Appends min, median and 99th percentile of every stage that was measured as CSV rows.
+void report(FILE *csv, Elham const *e) {
+    for (Stage stage = 0; stage < STAGE_COUNT; stage++) {
+        Samples *samples = e->stats + stage;
+        uint32_t n = samples->count;
+        if (n == 0) {
+            continue;
+        }
+        qsort(samples->values, n, sizeof(double), compareDoubles);
+        double median = n % 2 ? samples->values[n / 2] : (samples->values[n / 2 - 1] + samples->values[n / 2]) / 2;
+        uint32_t p99 = (uint32_t) ceil(0.99 * n) - 1;
+        fprintf(csv, "%u,%u,%s,%u,%s,%u,%.4f,%.4f,%.4f\n", e->width, e->height,
+                kernelNames[e->ycbcr.kernel], e->scene.instanceCount, stageNames[stage], n,
+                samples->values[0], median, samples->values[p99]);
+    }
+    fflush(csv);
+}
+
+/*
+ * Times recording every command buffer of the stream again on an idle device, which is what the frames save by
+ * recording them once at setup.
+ */
+void benchmarkRecording(Elham *e, unsigned iterations) {
+    for (unsigned n = 0; n < iterations; n++) {
+        double t = now();
+        for (Stage stage = 0; stage <= STAGE_YCBCR; stage++) {
+            if (e->commands[stage].buffers != NULL) {
+                recordCommandSet(e, stage);
+            }
+        }
+        record(e->stats + STAGE_RECORD, (now() - t) * 1e3);
+    }
+}
+
+void benchmark(FILE *csv, uint32_t width, uint32_t height, Kernel kernel, unsigned instances) {
+    Samples stats[STAGE_COUNT] = {0};
+    Elham e = {0};
+    e.stats = stats;
+    Options o = {.width = width, .height = height, .frames = BENCH_FRAMES, .inFlight = FRAMES_IN_FLIGHT,
+                 .queueDepth = ENCODE_QUEUE_DEPTH, .fps = "60/1", .preset = "ultrafast",
+                 .output = "/dev/null", .kernel = kernel,
+                 .color = {.format = FORMAT_I420, .matrix = MATRIX_BT709, .siting = CHROMA_LEFT, .depth = 8},
+                 .streams = 1, .instances = instances, .band = GPU_BAND_ROWS};
+
+    printf("Benchmarking %ux%u, %s kernel, %u instance(s)...\n", width, height, kernelNames[kernel],
+           instances > 0 ? instances : 1);
+    setup(&e, &o);
+    benchmarkRecording(&e, o.frames);
+    double start = now();
+    animate(&e, 1, o.frames);
+    reportDevices(&e, 1, now() - start);
+    destroyEncoder(&e);
+    report(csv, &e);
     cleanup(&e);
 
+    for (Stage stage = 0; stage < STAGE_COUNT; stage++) {
+        free(stats[stage].values);
+    }
+}
+
+/*
+ * Runs BENCH_FRAMES frames at every resolution in BENCH_RESOLUTIONS with each Y'CbCr kernel, then scenes of every
+ * count in BENCH_INSTANCES at the largest of them, and writes per-stage timings to the CSV file given as the first
+ * argument, bench.csv by default. The encoded stream is thrown away.
+ */
+int main(int argc, const char *argv[]) {
+    char const *path = argc > 1 ? argv[1] : "bench.csv";
+    FILE *csv = fopen(path, "w");
+    if (csv == NULL) {
+        printf("Failed to open %s.\n", path);
+        return EXIT_FAILURE;
+    }
+    fprintf(csv, "width,height,kernel,instances,stage,samples,min_ms,median_ms,p99_ms\n");
+    installSignalHandlers();
+
+    char const *resolution = BENCH_RESOLUTIONS;
+    uint32_t w, h, largestW = 0, largestH = 0;
+    int length;
+    while (!finished && *resolution != '\0') {
+        if (sscanf(resolution, "%ux%u%n", &w, &h, &length) != 2 || w == 0 || h == 0 || w % 2 || h % 2) {
+            printf("Invalid resolution at %s in ELHAM_BENCH_RESOLUTIONS, expected an even WIDTHxHEIGHT.\n",
+                   resolution);
+            return EXIT_FAILURE;
+        }
+        benchmark(csv, w, h, KERNEL_IMAGE, 0);
+        if (!finished && w % 8 == 0) {
+            benchmark(csv, w, h, KERNEL_PACKED, 0);
+        }
+        if (!finished) {
+            benchmark(csv, w, h, KERNEL_CPU, 0);
+        }
+        if ((uint64_t) w * h > (uint64_t) largestW * largestH) {
+            largestW = w;
+            largestH = h;
+        }
+        resolution += length;
+        if (*resolution == ';') {
+            resolution++;
+        }
+    }
+
+    // the stress test: draws stay one per shape however many instances there are
+    char const *instances = BENCH_INSTANCES;
+    unsigned count;
+    while (!finished && largestW > 0 && *instances != '\0') {
+        if (sscanf(instances, "%u%n", &count, &length) != 1) {
+            printf("Invalid scene size at %s in ELHAM_BENCH_INSTANCES.\n", instances);
+            return EXIT_FAILURE;
+        }
+        benchmark(csv, largestW, largestH, KERNEL_IMAGE, count);
+        instances += length;
+        if (*instances == ';') {
+            instances++;
+        }
+    }
+
+    fclose(csv);
+    printf("Wrote %s.\n", path);
     return EXIT_SUCCESS;
 }
+
+#else
+
+void usage(char const *name) {
+    printf("Usage: %s [options] [output]\n"
+           "  -s, --size WxH        frame size, both even (default 50x50)\n"
+           "  -n, --frames N        frames to render, 0 = until interrupted (default %u)\n"
+           "  -i, --in-flight N     frames rendered, converted and encoded at once, 1 = serial (default %u)\n"
+           "  -q, --queue-depth N   converted frames queued for the encoder (default %u)\n"
+           "  -r, --fps NUM[/DEN]   frame rate (default 60/1)\n"
+           "  -p, --preset NAME     x265 preset (default ultrafast)\n"
+           "  -t, --tune NAME       x265 tune (default none)\n"
+           "  -b, --bitrate KBPS    average bitrate, 0 = preset's rate control (default 0)\n"
+           "  -o, --output PATH     stream output, - for standard output (default output/stream.h265)\n"
+           "  -d, --device N|NAME   use the Nth listed device, or the first whose name contains NAME; a comma-\n"
+           "                        separated list splits the streams between several devices\n"
+           "  -k, --kernel NAME     Y'CbCr kernel, image, packed (width a multiple of 8) or cpu (8-bit i420\n"
+           "                        and nv12) (default %s)\n"
+           "  -F, --format NAME     pixel format, i420, nv12, i422 or i444 (default i420)\n"
+           "  -m, --matrix N        Y'CbCr matrix, 601, 709 or 2020 (default 709)\n"
+           "  -f, --full-range      full instead of limited range code values\n"
+           "  -c, --chroma-loc NAME chroma siting, left or center (default left)\n"
+           "  -D, --depth BITS      bits per sample, 8 or 10 (default 8)\n"
+           "  -I, --shaders DIR     load the .spv files from DIR instead of the shaders built into the binary\n"
+           "  -P, --cache-dir DIR   absolute directory to keep compiled pipelines in between runs, none for no\n"
+           "                        cache (default $XDG_CACHE_HOME/elham or ~/.cache/elham)\n"
+           "  -S, --streams N       independent animations, stream i goes to output-i, at least one per device\n"
+           "                        (default one per device)\n"
+           "  -N, --instances N     render a grid of N small shapes instead of one triangle\n"
+           "  -B, --gpu-band ROWS   render and convert frames on the device in bands of ROWS rows, which must\n"
+           "                        divide the height, so that device memory only holds a band; the readback\n"
+           "                        buffer and encoder still take whole frames. Needs the image kernel, direct\n"
+           "                        input and device-local planes (default %u, 0 = whole frames)\n"
+           "  -R, --dump-raw        write the RGBA pixels of every frame to output/NNNN, for debugging, only\n"
+           "                        without direct Y'CbCr input or with the cpu kernel\n"
+           "  -C, --check[=cpu]     convert the first frame with the kernel and the CPU converter and report the\n"
+           "                        samples that differ, check the vector CPU converters against the scalar one,\n"
+           "                        then exit, with failure if anything differed; cpu only checks the CPU\n"
+           "                        converters and needs no device\n",
+           name, FRAME_LIMIT, FRAMES_IN_FLIGHT, ENCODE_QUEUE_DEPTH, ELHAM_PACKED_YCBCR ? "packed" : "image",
+           GPU_BAND_ROWS);
+}
+
+void parseOptions(int argc, char *const argv[], Options *o) {
+    static struct option const longOptions[] = {
+        {"size", required_argument, NULL, 's'},
+        {"frames", required_argument, NULL, 'n'},
+        {"in-flight", required_argument, NULL, 'i'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"fps", required_argument, NULL, 'r'},
+        {"preset", required_argument, NULL, 'p'},
+        {"tune", required_argument, NULL, 't'},
+        {"bitrate", required_argument, NULL, 'b'},
+        {"output", required_argument, NULL, 'o'},
+        {"device", required_argument, NULL, 'd'},
+        {"kernel", required_argument, NULL, 'k'},
+        {"format", required_argument, NULL, 'F'},
+        {"matrix", required_argument, NULL, 'm'},
+        {"full-range", no_argument, NULL, 'f'},
+        {"chroma-loc", required_argument, NULL, 'c'},
+        {"depth", required_argument, NULL, 'D'},
+        {"streams", required_argument, NULL, 'S'},
+        {"shaders", required_argument, NULL, 'I'},
+        {"cache-dir", required_argument, NULL, 'P'},
+        {"instances", required_argument, NULL, 'N'},
+        {"gpu-band", required_argument, NULL, 'B'},
+        {"check", optional_argument, NULL, 'C'},
+        {"dump-raw", no_argument, NULL, 'R'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "s:n:i:q:r:p:t:b:o:d:k:F:m:fc:D:S:I:P:N:B:C::Rh", longOptions, NULL)) != -1) {
+        switch (c) {
+            case 's':
+                if (sscanf(optarg, "%ux%u", &o->width, &o->height) != 2 || o->width == 0 || o->height == 0 ||
+                    o->width % 2 || o->height % 2) {
+                    printf("Invalid size %s, expected an even WIDTHxHEIGHT.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                o->frames = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                o->inFlight = (uint32_t) strtoul(optarg, NULL, 10);
+                if (o->inFlight == 0) {
+                    printf("Invalid frames in flight %s.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                o->queueDepth = (uint32_t) strtoul(optarg, NULL, 10);
+                if (o->queueDepth == 0) {
+                    printf("Invalid encoder queue depth %s.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                o->fps = optarg;
+                break;
+            case 'p':
+                o->preset = optarg;
+                break;
+            case 't':
+                o->tune = optarg;
+                break;
+            case 'b':
+                o->bitrate = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                o->output = optarg;
+                break;
+            case 'd':
+                o->device = optarg;
+                break;
+            case 'k':
+                if (strcmp(optarg, "image") == 0) {
+                    o->kernel = KERNEL_IMAGE;
+                } else if (strcmp(optarg, "packed") == 0) {
+                    o->kernel = KERNEL_PACKED;
+                } else if (strcmp(optarg, "cpu") == 0) {
+                    o->kernel = KERNEL_CPU;
+                } else {
+                    printf("Unknown kernel %s, expected image, packed or cpu.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'F': {
+                uint32_t count = sizeof(pixelFormats) / sizeof(pixelFormats[0]);
+                uint32_t i = 0;
+                while (i < count && strcmp(optarg, pixelFormats[i].name) != 0) {
+                    i++;
+                }
+                if (i == count) {
+                    printf("Unknown pixel format %s, expected i420, nv12, i422 or i444.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                o->color.format = (PixelFormat) i;
+                break;
+            }
+            case 'm':
+                if (strcmp(optarg, "709") == 0) {
+                    o->color.matrix = MATRIX_BT709;
+                } else if (strcmp(optarg, "601") == 0) {
+                    o->color.matrix = MATRIX_BT601;
+                } else if (strcmp(optarg, "2020") == 0) {
+                    o->color.matrix = MATRIX_BT2020;
+                } else {
+                    printf("Unknown matrix %s, expected 601, 709 or 2020.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                o->color.fullRange = true;
+                break;
+            case 'c':
+                if (strcmp(optarg, "left") == 0) {
+                    o->color.siting = CHROMA_LEFT;
+                } else if (strcmp(optarg, "center") == 0) {
+                    o->color.siting = CHROMA_CENTER;
+                } else {
+                    printf("Unknown chroma location %s, expected left or center.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'D':
+                o->color.depth = (uint32_t) strtoul(optarg, NULL, 10);
+                if (o->color.depth != 8 && o->color.depth != 10) {
+                    printf("Unsupported depth %s, expected 8 or 10.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                o->streams = (unsigned) strtoul(optarg, NULL, 10);
+                if (o->streams == 0) {
+                    printf("Invalid stream count %s.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'I':
+                o->shaders = optarg;
+                break;
+            case 'P':
+                if (optarg[0] != '/' && strcmp(optarg, "none") != 0) {
+                    printf("Invalid cache directory %s, expected an absolute path or none.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                o->cacheDir = optarg;
+                break;
+            case 'N':
+                o->instances = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                o->band = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                if (optarg == NULL) {
+                    o->check = CHECK_ALL;
+                } else if (strcmp(optarg, "cpu") == 0) {
+                    o->check = CHECK_CPU;
+                } else {
+                    printf("Unknown check %s, expected cpu.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+                o->dumpRaw = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) {
+        o->output = argv[optind];
+    }
+}
+
+// Where stream index of count goes: the output itself for a single stream, else with -index before its extension.
+char *streamOutput(char const *output, unsigned index, unsigned count) {
+    char const *slash = strrchr(output, '/');
+    char const *name = slash != NULL ? slash + 1 : output;
+    char const *dot = strrchr(name, '.');
+    if (dot == NULL || dot == name) {
+        dot = name + strlen(name);
+    }
+    size_t length = strlen(output) + 16;
+    char *path = malloc(length);
+    if (count == 1) {
+        snprintf(path, length, "%s", output);
+    } else {
+        snprintf(path, length, "%.*s-%u%s", (int) (dot - output), output, index, dot);
+    }
+    return path;
+}
+
+// Splits a comma-separated list of device selections in place, a NULL list is one NULL selection, the best device.
+char **splitDevices(char *list, unsigned *count) {
+    unsigned n = 1;
+    for (char const *c = list; c != NULL && *c != '\0'; c++) {
+        n += *c == ',';
+    }
+    char **selections = calloc(n, sizeof(char *));
+    *count = 0;
+    for (char *s = list != NULL ? strtok(list, ",") : NULL; s != NULL; s = strtok(NULL, ",")) {
+        selections[(*count)++] = s;
+    }
+    if (*count == 0) {
+        *count = 1;
+    }
+    return selections;
+}
+
+int main(int argc, char *argv[]) {
+    Options o = {.width = 50, .height = 50, .frames = FRAME_LIMIT, .inFlight = FRAMES_IN_FLIGHT,
+                 .queueDepth = ENCODE_QUEUE_DEPTH, .fps = "60/1", .preset = "ultrafast",
+                 .output = "output/stream.h265", .kernel = ELHAM_PACKED_YCBCR ? KERNEL_PACKED : KERNEL_IMAGE,
+                 .color = {.format = FORMAT_I420, .matrix = MATRIX_BT709, .siting = CHROMA_LEFT, .depth = 8},
+                 .streams = 0, .band = GPU_BAND_ROWS};
+    parseOptions(argc, argv, &o);
+    if (o.check == CHECK_CPU) {
+        // the CPU converter only needs the colour format, and only writes 8-bit samples
+        Elham e = {0};
+        e.color = o.color;
+        e.color.depth = 8;
+        return checkCpuRows(&e) > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    char *deviceList = o.device != NULL ? strdup(o.device) : NULL;
+    unsigned deviceCount;
+    char **devices = splitDevices(deviceList, &deviceCount);
+    if (o.streams == 0) {
+        o.streams = deviceCount;
+        if (deviceCount > 1) {
+            char *firstOutput = streamOutput(o.output, 0, deviceCount);
+            char *lastOutput = streamOutput(o.output, deviceCount - 1, deviceCount);
+            printf("%u devices, rendering one stream on each into %s to %s, not %s.\n", deviceCount, firstOutput,
+                   lastOutput, o.output);
+            free(firstOutput);
+            free(lastOutput);
+        }
+    } else if (o.streams < deviceCount) {
+        printf("%u stream(s) cannot be split between %u devices, use at least -S %u.\n", o.streams, deviceCount,
+               deviceCount);
+        exit(EXIT_FAILURE);
+    }
+    if (o.streams > 1 && strcmp(o.output, "-") == 0) {
+        printf("Several streams cannot all go to standard output.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Each device gets a contiguous run of streams, the first of which creates the device and the rest borrow it.
+    Elham *streams = calloc(o.streams, sizeof(Elham));
+    char **outputs = calloc(o.streams, sizeof(char *));
+    Elham *owner = NULL;
+    for (unsigned i = 0; i < o.streams; i++) {
+        unsigned d = i * deviceCount / o.streams;
+        Options stream = o;
+        outputs[i] = streamOutput(o.output, i, o.streams);
+        stream.output = outputs[i];
+        stream.device = devices[d];
+        if (i == 0 || (i - 1) * deviceCount / o.streams != d) {
+            owner = streams + i;
+            setup(owner, &stream);
+        } else {
+            printf("Set up stream %u...\n", i);
+            setupStream(streams + i, owner, &stream);
+        }
+    }
+    int status = EXIT_SUCCESS;
+    if (o.check == CHECK_ALL) {
+        unsigned failures = checkCpuRows(streams) + checkYCbCr(streams);
+        status = failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else {
+        if (BENCHMARK_YCBCR > 0) {
+            benchmarkYCbCr(streams, BENCHMARK_YCBCR);
+        }
+        installSignalHandlers();
+        animateDevices(streams, o.streams, o.frames);
+    }
+
+    for (unsigned i = 0; i < o.streams; i++) {
+        destroyEncoder(streams + i);
+    }
+    // borrowers come after the stream whose device they use, so they go first
+    for (unsigned i = o.streams; i-- > 0;) {
+        if (streams[i].shared != NULL) {
+            destroyStream(streams + i);
+        } else {
+            cleanup(streams + i);
+        }
+    }
+    for (unsigned i = 0; i < o.streams; i++) {
+        free(outputs[i]);
+    }
+    free(outputs);
+    free(streams);
+    free(devices);
+    free(deviceList);
+
+    return status;
+}
+
+#endif
@@ -1,5 +1,8 @@
 #!/usr/bin/env sh
+# The build embeds the shaders in the binary, this compiles them next to their sources for --shaders shaders.
 GLSLC=`which glslc`
 $GLSLC shader.vert -o vert.spv
 $GLSLC shader.frag -o frag.spv
-$GLSLC ycbcr.comp -o ycbcr.spv
\ No newline at end of file
+$GLSLC ycbcr.comp -o ycbcr.spv
+$GLSLC -DPLANE_FORMAT=r16 ycbcr.comp -o ycbcr16.spv
+$GLSLC ycbcr_packed.comp -o ycbcr_packed.spv
\ No newline at end of file
@@ -0,0 +1,10 @@
+# Writes the SPIR-V file INPUT to OUTPUT as a C array named NAME, for the shaders CMakeLists.txt embeds in the binary:
+#   cmake -DINPUT=vert.spv -DNAME=vert_spv -DOUTPUT=vert_spv.h -P embed.cmake
+file(READ ${INPUT} HEX HEX)
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," BYTES "${HEX}")
+string(REPEAT "0x[0-9a-f][0-9a-f]," 16 LINE)
+string(REGEX REPLACE "(${LINE})" "\\1\n    " BYTES "${BYTES}")
+string(REGEX REPLACE "\n    $" "" BYTES "${BYTES}")
+file(WRITE ${OUTPUT}
+     "// Generated from ${INPUT} by shaders/embed.cmake, do not edit.\n"
+     "_Alignas(uint32_t) static unsigned char const ${NAME}[] = {\n    ${BYTES}\n};\n")
@@ -3,10 +3,28 @@
 
 layout(location = 0) in vec2 inPosition;
 layout(location = 1) in vec3 inColor;
+// per instance, see Instance
+layout(location = 2) in vec2 inOffset;
+layout(location = 3) in vec2 inScale;
+layout(location = 4) in vec3 inTint;
+
+// Where the frame puts the static vertices, written by the host into the frame's own buffer, see writeTransform().
+layout(std140, binding = 0) uniform Transform {
+    mat2 rotation;
+    vec2 center;
+};
+
+// Stretches the rows of the band being rendered over the whole render target, 1 and 0 for whole frames, see
+// recordSceneCommands().
+layout(push_constant) uniform Band {
+    float bandScale;
+    float bandOffset;
+};
 
 layout(location = 0) out vec3 fragColor;
 
 void main() {
-    gl_Position = vec4(inPosition, 0.0, 1.0);
-    fragColor = inColor;
-}
\ No newline at end of file
+    vec2 position = rotation * (inPosition * inScale + inOffset - center) + center;
+    gl_Position = vec4(position.x, position.y * bandScale + bandOffset, 0.0, 1.0);
+    fragColor = inColor * inTint;
+}